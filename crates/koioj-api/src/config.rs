@@ -20,4 +20,5 @@ pub struct Config {
     pub admin_password: Option<String>,
     pub data_dir: String,
     pub judgers: HashMap<String, String>,
+    pub shard_tests: Option<usize>,
 }
@@ -17,7 +17,10 @@ use sqlx::{
     ConnectOptions, PgPool,
     postgres::{PgConnectOptions, PgPoolOptions},
 };
-use std::{collections::HashMap, path::PathBuf};
+use std::{
+    collections::{HashMap, HashSet},
+    path::PathBuf,
+};
 use std::{
     net::{IpAddr, Ipv4Addr, SocketAddr},
     str::FromStr,
@@ -39,7 +42,7 @@ use crate::{
         ContestContent, ProblemContent, SolutionContent, SubmissionCode, TestCaseData,
         TrainingPlanContent,
     },
-    route::judge::JudgeConnection,
+    route::judge::{JudgeConnection, Shards},
 };
 
 pub type State = axum::extract::State<Arc<AppState>>;
@@ -51,6 +54,10 @@ pub struct AppState {
     pub started: Instant,
 
     pub judges: Arc<RwLock<HashMap<String, JudgeConnection>>>,
+    /// Submissions split across judges, by id.
+    pub shards: Arc<RwLock<HashMap<i32, Shards>>>,
+    /// Judges each unfinished submission was sent to, by id.
+    pub dispatched: Arc<RwLock<HashMap<i32, HashSet<String>>>>,
 }
 
 impl AppState {
@@ -72,6 +79,8 @@ impl AppState {
             redis: redis_manager,
             started: Instant::now(),
             judges: Arc::new(RwLock::new(HashMap::new())),
+            shards: Arc::new(RwLock::new(HashMap::new())),
+            dispatched: Arc::new(RwLock::new(HashMap::new())),
         })
     }
 
@@ -287,6 +296,22 @@ impl AppState {
         self.read_json_data(path).await
     }
 
+    /// Hashes a test case stored before content hashes existed and records it.
+    pub async fn backfill_test_case_hash(&self, test_case_id: i32) -> Result<String> {
+        let hash = self.read_test_cases(test_case_id).await?.hash();
+        sqlx::query!(
+            r#"
+        UPDATE test_cases SET content_hash = $1 WHERE id = $2
+        "#,
+            hash,
+            test_case_id
+        )
+        .execute(&self.pool)
+        .await
+        .map_err(|e| Error::msg(format!("database error: {}", e)))?;
+        Ok(hash)
+    }
+
     pub async fn write_solution_content(
         &self,
         solution_id: i32,
@@ -9,13 +9,20 @@ use axum::{
 };
 use futures::{sink::SinkExt, stream::StreamExt};
 use koioj_common::judge::{
-    ApiToJudgeMessage, JudgeInfo, JudgeLoad, JudgeTask, JudgeToApiMessage, Language,
-    SubmissionResult, TestCaseJudgeResult,
+    ApiToJudgeMessage, JudgeInfo, JudgeLoad, JudgeResult, JudgeTask, JudgeToApiMessage, Language,
+    SubmissionResult, TestCase, TestCaseJudgeResult, TestCaseResult,
 };
 use koioj_common::{bail, error::Context};
 use rand::Rng;
 use serde::{Deserialize, Serialize};
-use std::{sync::Arc, time::Instant};
+use std::{
+    collections::HashMap,
+    sync::{
+        Arc,
+        atomic::{AtomicU32, Ordering},
+    },
+    time::Instant,
+};
 use tokio::sync::{RwLock, mpsc};
 use utoipa::ToSchema;
 
@@ -38,35 +45,64 @@ pub struct JudgeConnection {
     pub load: JudgeLoad,
     pub sender: mpsc::UnboundedSender<ApiToJudgeMessage>,
     pub last_heartbeat: Arc<RwLock<Instant>>,
+    /// Test cases sent since the last ping, which `load` doesn't know of yet.
+    pub dispatched_tests: Arc<AtomicU32>,
 }
 impl JudgeConnection {
-    pub fn load_score(&self) -> f32 {
-        (self.load.running_tasks as f32) * 100.0
-            + self.load.cpu_usage * 0.5
-            + self.load.memory_usage * 0.3
+    /// Test cases waiting per sandbox. Judges too old to report their
+    /// sandboxes count as one each.
+    pub fn outstanding_work(&self) -> f32 {
+        let queued = self.load.queued_tests + self.dispatched_tests.load(Ordering::Relaxed);
+        queued as f32 / self.load.sandbox_slots.max(1) as f32
+    }
+
+    /// Less is less busy. At equal work the judge whose tasks waited less
+    /// recently goes first.
+    fn schedule_key(&self) -> (f32, u64) {
+        (self.outstanding_work(), self.load.queue_wait_p99_us)
     }
 }
 
+/// Test cases per part when a submission is split across judges.
+const DEFAULT_SHARD_TESTS: usize = 64;
+
+/// A submission out on several judges, the parts merged as they come back.
+pub struct Shards {
+    remaining: usize,
+    merged: Option<JudgeResult>,
+    /// A part failed, which fails the whole submission.
+    failed: bool,
+}
+
+/// Judges with a recent heartbeat that support `lang`.
+async fn available_judges(
+    judges: &HashMap<String, JudgeConnection>,
+    lang: Language,
+) -> Vec<(&String, &JudgeConnection)> {
+    let now = Instant::now();
+    let mut available = Vec::new();
+    for (id, conn) in judges.iter() {
+        let last_heartbeat = *conn.last_heartbeat.read().await;
+        if now.duration_since(last_heartbeat).as_secs() < 60 && conn.info.languages.contains(&lang)
+        {
+            available.push((id, conn));
+        }
+    }
+    available
+}
+
 impl crate::AppState {
-    pub async fn select_judge(&self, lang: Language) -> Result<String> {
+    /// Picks the less busy of two random judges, which spreads bursts evenly
+    /// while the loads reported are seconds old. `weight` is the number of
+    /// test cases of the task, charged to the judge until its next ping.
+    pub async fn select_judge(&self, lang: Language, weight: u32) -> Result<String> {
         let judges = self.judges.read().await;
 
         if judges.is_empty() {
             bail!("no available judge");
         }
 
-        // filter timeout judgers and language support
-        let now = Instant::now();
-        let mut available_judges = Vec::new();
-        for (id, conn) in judges.iter() {
-            let last_heartbeat = *conn.last_heartbeat.read().await;
-            if now.duration_since(last_heartbeat).as_secs() < 60
-                && conn.info.languages.contains(&lang)
-            {
-                available_judges.push((id, conn));
-            }
-        }
-
+        let available_judges = available_judges(&judges, lang).await;
         if available_judges.is_empty() {
             bail!(
                 "no available judge supporting {:?} (all timeout or language not supported)",
@@ -74,29 +110,59 @@ impl crate::AppState {
             );
         }
 
-        // load
-        let mut load_scores: Vec<(String, f32)> = available_judges
-            .iter()
-            .map(|(id, conn)| (id.to_string(), conn.load_score()))
-            .collect();
-
-        load_scores.sort_by(|a, b| a.1.partial_cmp(&b.1).unwrap());
-
-        let min_score = load_scores[0].1;
+        // power of two choices
+        let mut rng = rand::rng();
+        let mut selected = available_judges[rng.random_range(0..available_judges.len())];
+        if available_judges.len() > 1 {
+            let other = loop {
+                let other = available_judges[rng.random_range(0..available_judges.len())];
+                if other.0 != selected.0 {
+                    break other;
+                }
+            };
+            if other.1.schedule_key() < selected.1.schedule_key() {
+                selected = other;
+            }
+        }
 
-        // get candidates
-        let threshold = min_score * 1.2;
-        let candidates: Vec<String> = load_scores
-            .iter()
-            .filter(|(_, score)| *score <= threshold)
-            .map(|(id, _)| id.clone())
-            .collect();
+        let (id, conn) = selected;
+        conn.dispatched_tests
+            .fetch_add(weight.max(1), Ordering::Relaxed);
+        Ok(id.clone())
+    }
 
-        // random to prevent always the first
-        let mut rng = rand::rng();
-        let selected_idx = rng.random_range(0..candidates.len());
+    /// Distinct judges for the parts of a split submission, the least busy
+    /// ones, at most `parts` of them. Each is charged its share of `tests`.
+    pub async fn select_judges(
+        &self,
+        lang: Language,
+        parts: usize,
+        tests: usize,
+    ) -> Result<Vec<String>> {
+        let judges = self.judges.read().await;
+        let mut available_judges = available_judges(&judges, lang).await;
+        if available_judges.is_empty() {
+            bail!(
+                "no available judge supporting {:?} (all timeout or language not supported)",
+                lang
+            );
+        }
 
-        Ok(candidates[selected_idx].clone())
+        available_judges.sort_by(|a, b| {
+            a.1.schedule_key()
+                .partial_cmp(&b.1.schedule_key())
+                .unwrap_or(std::cmp::Ordering::Equal)
+        });
+        available_judges.truncate(parts);
+        let weight = tests.div_ceil(available_judges.len()) as u32;
+        Ok(available_judges
+            .into_iter()
+            .map(|(id, conn)| {
+                conn.dispatched_tests
+                    .fetch_add(weight.max(1), Ordering::Relaxed);
+                id.clone()
+            })
+            .collect())
     }
 
     pub async fn send_judge_task(&self, judge_id: &str, task: JudgeTask) -> Result<()> {
@@ -106,16 +172,133 @@ impl crate::AppState {
             .get(judge_id)
             .ok_or_else(|| Error::msg(format!("judge not found: {}", judge_id)))?;
 
-        conn.sender
-            .send(ApiToJudgeMessage::JudgeTask(task))
-            .map_err(|e| Error::msg(format!("failed to send task: {}", e)))?;
+        // before the send, progress may come back right after it
+        let submission_id = task.submission_id;
+        self.dispatched
+            .write()
+            .await
+            .entry(submission_id)
+            .or_default()
+            .insert(judge_id.to_string());
+        if let Err(e) = conn.sender.send(ApiToJudgeMessage::JudgeTask(task)) {
+            let mut dispatched = self.dispatched.write().await;
+            if let Some(judge_ids) = dispatched.get_mut(&submission_id) {
+                judge_ids.remove(judge_id);
+                if judge_ids.is_empty() {
+                    dispatched.remove(&submission_id);
+                }
+            }
+            return Err(Error::msg(format!("failed to send task: {}", e)));
+        }
+
+        Ok(())
+    }
 
+    /// Whether `submission_id` is still being judged and was sent to
+    /// `judge_id`.
+    async fn is_dispatched(&self, submission_id: i32, judge_id: &str) -> bool {
+        self.dispatched
+            .read()
+            .await
+            .get(&submission_id)
+            .is_some_and(|judge_ids| judge_ids.contains(judge_id))
+    }
+
+    /// Splits submissions with many test cases across the available judges,
+    /// each of which compiles on its own and judges its part.
+    pub async fn submit_judge_task(self: &Arc<Self>, mut task: JudgeTask) -> Result<()> {
+        let shard_tests = self.config.shard_tests.unwrap_or(DEFAULT_SHARD_TESTS);
+        let wanted = match shard_tests {
+            0 => 1,
+            n => task.test_cases.len().div_ceil(n),
+        };
+        if wanted <= 1 {
+            let judge_id = self
+                .select_judge(task.lang, task.test_cases.len() as u32)
+                .await?;
+            return self.send_judge_task(&judge_id, task).await;
+        }
+
+        // one part per judge, more would only queue behind each other there
+        let judge_ids = self
+            .select_judges(task.lang, wanted, task.test_cases.len())
+            .await?;
+        let parts = judge_ids.len();
+        if parts == 1 {
+            return self.send_judge_task(&judge_ids[0], task).await;
+        }
+
+        // interleaved, test sets tend to grow towards their end
+        let test_cases = std::mem::take(&mut task.test_cases);
+        let mut shards = vec![task.clone(); parts];
+        for (i, test_case) in test_cases.into_iter().enumerate() {
+            shards[i % parts].test_cases.push(test_case);
+        }
+
+        let submission_id = task.submission_id;
+        self.shards.write().await.insert(
+            submission_id,
+            Shards {
+                remaining: parts,
+                merged: None,
+                failed: false,
+            },
+        );
+        for (sent, (judge_id, shard)) in judge_ids.iter().zip(shards).enumerate() {
+            if let Err(e) = self.send_judge_task(judge_id, shard).await {
+                tracing::error!(
+                    "Failed to submit part of submission {}: {:?}",
+                    submission_id,
+                    e
+                );
+                let mut all_shards = self.shards.write().await;
+                if sent == 0 {
+                    all_shards.remove(&submission_id);
+                    return Err(e);
+                }
+                // the parts out already end the submission
+                let Some(pending) = all_shards.get_mut(&submission_id) else {
+                    return Ok(());
+                };
+                pending.remaining -= parts - sent;
+                pending.failed = true;
+                if pending.remaining > 0 {
+                    return Ok(());
+                }
+                // unless they all came back before this one failed to go out
+                all_shards.remove(&submission_id);
+                drop(all_shards);
+                return fail_submission(self, submission_id).await;
+            }
+        }
+        tracing::debug!("Submission {} split across {} judges", submission_id, parts);
         Ok(())
     }
 
-    pub async fn submit_judge_task(&self, task: JudgeTask) -> Result<()> {
-        let judge_id = self.select_judge(task.lang).await?;
-        self.send_judge_task(&judge_id, task).await
+    /// Takes in the result of a submission or one of its parts, `None` if the
+    /// judge failed it. Returns nothing while parts are still out, then the
+    /// result of the whole submission, `None` again if any part failed.
+    async fn merge_shard(
+        &self,
+        submission_id: i32,
+        part: Option<JudgeResult>,
+    ) -> Option<Option<JudgeResult>> {
+        let mut all_shards = self.shards.write().await;
+        let Some(pending) = all_shards.get_mut(&submission_id) else {
+            return Some(part);
+        };
+        match (part, &mut pending.merged) {
+            (Some(result), Some(merged)) => merged.merge(result),
+            (Some(result), None) => pending.merged = Some(result),
+            (None, _) => pending.failed = true,
+        }
+        pending.remaining -= 1;
+        if pending.remaining > 0 {
+            return None;
+        }
+
+        let pending = all_shards.remove(&submission_id)?;
+        Some(pending.merged.filter(|_| !pending.failed))
     }
 }
 
@@ -234,13 +417,10 @@ async fn handle_judge_message(
 
             let conn = JudgeConnection {
                 info: info.clone(),
-                load: JudgeLoad {
-                    running_tasks: 0,
-                    cpu_usage: 0.0,
-                    memory_usage: 0.0,
-                },
+                load: JudgeLoad::default(),
                 sender: tx.clone(),
                 last_heartbeat: Arc::new(RwLock::new(Instant::now())),
+                dispatched_tests: Arc::new(AtomicU32::new(0)),
             };
 
             let mut judges = state.judges.write().await;
@@ -260,6 +440,8 @@ async fn handle_judge_message(
                 let mut judges = state.judges.write().await;
                 if let Some(conn) = judges.get_mut(id) {
                     conn.load = load;
+                    // queued_tests has them now
+                    conn.dispatched_tests.store(0, Ordering::Relaxed);
                     let mut last_heartbeat = conn.last_heartbeat.write().await;
                     *last_heartbeat = Instant::now();
                 }
@@ -268,133 +450,215 @@ async fn handle_judge_message(
             tx.send(ApiToJudgeMessage::Pong)?;
         }
         JudgeToApiMessage::JudgeProgress(progress) => {
+            if !*registered {
+                tracing::warn!("Received progress from unregistered judge");
+                return Ok(());
+            }
+            // a stray or late message must not overwrite a finished submission
+            let from = judge_id.as_deref().unwrap_or_default();
+            if !state.is_dispatched(progress.submission_id, from).await {
+                tracing::warn!(
+                    "Judge {} sent progress of submission {} it isn't judging",
+                    from,
+                    progress.submission_id
+                );
+                return Ok(());
+            }
+
             tracing::debug!(
                 "Submission {} progress: {}/{}",
                 progress.submission_id,
                 progress.completed_tests,
                 progress.total_tests
             );
-            // TODO: somehow broadcast to frontend?
+            // pages polling the submission pick the rows up as they land
+            insert_test_results(state, progress.submission_id, &progress.test_results).await?;
         }
-        JudgeToApiMessage::JudgeResult(result) => {
-            tracing::info!(
-                "Submission {} result: {:?}, time: {}ms, memory: {}KB",
-                result.submission_id,
-                result.result,
-                result.time_consumption,
-                result.memory_consumption
-            );
-
-            let submission = sqlx::query!(
-                r#"
-                SELECT user_id, problem_id, contest_id, created_at
-                FROM submissions
-                WHERE id = $1
-                "#,
-                result.submission_id
-            )
-            .fetch_one(&state.pool)
-            .await?;
-
-            sqlx::query!(
-                r#"
-                UPDATE submissions 
-                SET result = $1, time_consumption = $2, mem_consumption = $3, updated_at = NOW()
-                WHERE id = $4
-                "#,
-                result.result as SubmissionResult,
-                result.time_consumption,
-                result.memory_consumption,
-                result.submission_id
-            )
-            .execute(&state.pool)
-            .await?;
-
-            for test_result in result.test_results {
-                sqlx::query!(
-                    r#"
-                    INSERT INTO submission_test_cases 
-                    (submission_id, test_case_id, result, time_consumption, mem_consumption)
-                    VALUES ($1, $2, $3, $4, $5)
-                    "#,
-                    result.submission_id,
-                    test_result.test_case_id,
-                    test_result.result as TestCaseJudgeResult,
-                    test_result.time_consumption,
-                    test_result.memory_consumption
-                )
-                .execute(&state.pool)
-                .await?;
+        JudgeToApiMessage::FetchTestCases(ids) => {
+            if !*registered {
+                tracing::warn!("Received test case fetch from unregistered judge");
+                return Ok(());
             }
 
-            if let Some(contest_id) = submission.contest_id {
-                if let Err(e) = crate::route::contests::ranking_cache::update_ranking_on_submission(
-                    &state,
-                    contest_id,
-                    submission.user_id,
-                    submission.problem_id,
-                    result.result,
-                    submission.created_at,
-                )
-                .await
-                {
-                    tracing::error!("Failed to update ranking cache: {:?}", e);
-                    // Don't fail the whole operation if cache update fails
-                }
+            tracing::debug!("Judge fetching {} test cases", ids.len());
+            // one message per test case keeps each frame at the size of its data
+            for id in ids {
+                let data = state.read_test_cases(id).await?;
+                tx.send(ApiToJudgeMessage::TestCases(vec![TestCase { id, data }]))?;
+            }
+        }
+        JudgeToApiMessage::JudgeResult(result) => {
+            let id = result.submission_id;
+            match state.merge_shard(id, Some(result)).await {
+                Some(Some(result)) => finish_submission(state, result).await?,
+                Some(None) => fail_submission(state, id).await?,
+                None => {}
             }
         }
         JudgeToApiMessage::Error(id, msg) => {
             tracing::error!("Submission {} judge error: {}", id, msg);
+            if state.merge_shard(id, None).await.is_some() {
+                fail_submission(state, id).await?;
+            }
+        }
+    }
 
-            // Get submission info to check if it's in a contest
-            let submission = sqlx::query!(
-                r#"
-                SELECT user_id, problem_id, contest_id, created_at
-                FROM submissions
-                WHERE id = $1
-                "#,
-                id
-            )
-            .fetch_one(&state.pool)
-            .await?;
+    Ok(())
+}
 
-            sqlx::query!(
-                r#"
-                UPDATE submissions 
-                SET result = $1, time_consumption = $2, mem_consumption = $3, updated_at = NOW()
-                WHERE id = $4
-                "#,
-                SubmissionResult::UnknownError as SubmissionResult,
-                0,
-                0,
-                id
-            )
-            .execute(&state.pool)
-            .await?;
+/// Stores the verdict of a fully judged submission.
+async fn finish_submission(state: &State, result: JudgeResult) -> Result<()> {
+    state.dispatched.write().await.remove(&result.submission_id);
+    tracing::info!(
+        "Submission {} result: {:?}, time: {}ms, memory: {}KB",
+        result.submission_id,
+        result.result,
+        result.time_consumption,
+        result.memory_consumption
+    );
+
+    let submission = sqlx::query!(
+        r#"
+        SELECT user_id, problem_id, contest_id, created_at
+        FROM submissions
+        WHERE id = $1
+        "#,
+        result.submission_id
+    )
+    .fetch_one(&state.pool)
+    .await?;
+
+    sqlx::query!(
+        r#"
+        UPDATE submissions 
+        SET result = $1, time_consumption = $2, mem_consumption = $3, updated_at = NOW()
+        WHERE id = $4
+        "#,
+        result.result as SubmissionResult,
+        result.time_consumption,
+        result.memory_consumption,
+        result.submission_id
+    )
+    .execute(&state.pool)
+    .await?;
+
+    insert_test_results(state, result.submission_id, &result.test_results).await?;
+
+    if let Some(contest_id) = submission.contest_id {
+        if let Err(e) = crate::route::contests::ranking_cache::update_ranking_on_submission(
+            &state,
+            contest_id,
+            submission.user_id,
+            submission.problem_id,
+            result.result,
+            submission.created_at,
+        )
+        .await
+        {
+            tracing::error!("Failed to update ranking cache: {:?}", e);
+            // Don't fail the whole operation if cache update fails
+        }
+    }
 
-            // Update ranking cache if this is a contest submission
-            // UnknownError is treated as a failed attempt
-            if let Some(contest_id) = submission.contest_id {
-                if let Err(e) = crate::route::contests::ranking_cache::update_ranking_on_submission(
-                    &state,
-                    contest_id,
-                    submission.user_id,
-                    submission.problem_id,
-                    SubmissionResult::UnknownError,
-                    submission.created_at,
-                )
-                .await
-                {
-                    tracing::error!("Failed to update ranking cache: {:?}", e);
-                    // Don't fail the whole operation if cache update fails
-                }
-            }
+    Ok(())
+}
+
+/// Marks a submission the judges failed on as an unknown error.
+async fn fail_submission(state: &Arc<AppState>, id: i32) -> Result<()> {
+    state.dispatched.write().await.remove(&id);
+    // Get submission info to check if it's in a contest
+    let submission = sqlx::query!(
+        r#"
+        SELECT user_id, problem_id, contest_id, created_at
+        FROM submissions
+        WHERE id = $1
+        "#,
+        id
+    )
+    .fetch_one(&state.pool)
+    .await?;
+
+    sqlx::query!(
+        r#"
+        UPDATE submissions 
+        SET result = $1, time_consumption = $2, mem_consumption = $3, updated_at = NOW()
+        WHERE id = $4
+        "#,
+        SubmissionResult::UnknownError as SubmissionResult,
+        0,
+        0,
+        id
+    )
+    .execute(&state.pool)
+    .await?;
+
+    // Update ranking cache if this is a contest submission
+    // UnknownError is treated as a failed attempt
+    if let Some(contest_id) = submission.contest_id {
+        if let Err(e) = crate::route::contests::ranking_cache::update_ranking_on_submission(
+            &state,
+            contest_id,
+            submission.user_id,
+            submission.problem_id,
+            SubmissionResult::UnknownError,
+            submission.created_at,
+        )
+        .await
+        {
+            tracing::error!("Failed to update ranking cache: {:?}", e);
+            // Don't fail the whole operation if cache update fails
         }
     }
 
     Ok(())
 }
 
+/// Inserts test case results in a single statement. A result sent twice
+/// overwrites the first.
+async fn insert_test_results(
+    state: &State,
+    submission_id: i32,
+    results: &[TestCaseResult],
+) -> Result<()> {
+    if results.is_empty() {
+        return Ok(());
+    }
+
+    let test_case_ids: Vec<i32> = results.iter().map(|r| r.test_case_id).collect();
+    let verdicts: Vec<TestCaseJudgeResult> = results.iter().map(|r| r.result.clone()).collect();
+    let times: Vec<i32> = results.iter().map(|r| r.time_consumption).collect();
+    let mems: Vec<i32> = results.iter().map(|r| r.memory_consumption).collect();
+    let times_us: Vec<i64> = results.iter().map(|r| r.time_us).collect();
+    let wall_times_us: Vec<i64> = results.iter().map(|r| r.wall_time_us).collect();
+
+    sqlx::query!(
+        r#"
+        INSERT INTO submission_test_cases
+        (submission_id, test_case_id, result, time_consumption, mem_consumption,
+         time_us, wall_time_us)
+        SELECT $1::INTEGER, * FROM UNNEST(
+            $2::INTEGER[], $3::test_case_result_enum[], $4::INTEGER[], $5::INTEGER[],
+            $6::BIGINT[], $7::BIGINT[]
+        )
+        ON CONFLICT (submission_id, test_case_id) DO UPDATE
+        SET result = EXCLUDED.result, time_consumption = EXCLUDED.time_consumption,
+            mem_consumption = EXCLUDED.mem_consumption, time_us = EXCLUDED.time_us,
+            wall_time_us = EXCLUDED.wall_time_us
+        "#,
+        submission_id,
+        &test_case_ids,
+        &verdicts as &[TestCaseJudgeResult],
+        &times,
+        &mems,
+        &times_us,
+        &wall_times_us
+    )
+    .execute(&state.pool)
+    .await?;
+
+    Ok(())
+}
+
 #[derive(Serialize, Deserialize, ToSchema)]
 #[serde(rename_all = "camelCase")]
 pub(crate) struct GetSupportedLanguagesResponse {
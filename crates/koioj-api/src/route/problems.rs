@@ -6,7 +6,9 @@ use axum::{
     middleware,
 };
 use chrono::{DateTime, Utc};
-use koioj_common::judge::{JudgeTask, SubmissionResult, TestCase, TestCaseJudgeResult};
+use koioj_common::judge::{
+    Checker, JudgeTask, Priority, SubmissionResult, TestCaseJudgeResult, TestCaseRef,
+};
 use koioj_common::{bail, judge::Language};
 use serde::{Deserialize, Serialize};
 use sqlx::Row;
@@ -601,9 +603,10 @@ async fn add_test_cases(
     for test_case in p.test_cases.iter() {
         let result = sqlx::query!(
             r#"
-        INSERT INTO test_cases (problem_id) VALUES ($1) RETURNING id
+        INSERT INTO test_cases (problem_id, content_hash) VALUES ($1, $2) RETURNING id
         "#,
-            problem_id
+            problem_id,
+            test_case.hash()
         )
         .fetch_one(&state.pool)
         .await
@@ -1064,19 +1067,23 @@ async fn submit(
 
     let test_case_records = sqlx::query!(
         r#"
-        SELECT id FROM test_cases WHERE problem_id = $1 ORDER BY id
+        SELECT id, content_hash FROM test_cases WHERE problem_id = $1 ORDER BY id
         "#,
         problem_id
     )
     .fetch_all(&state.pool)
     .await
     .map_err(|e| Error::msg(format!("database error: {}", e)))?;
+    // judges fetch the data they don't have cached, by hash
     let mut test_cases = Vec::new();
     for record in test_case_records {
-        let test_case_data = state.read_test_cases(record.id).await?;
-        test_cases.push(TestCase {
+        let hash = match record.content_hash {
+            Some(hash) => hash,
+            None => state.backfill_test_case_hash(record.id).await?,
+        };
+        test_cases.push(TestCaseRef {
             id: record.id,
-            data: test_case_data,
+            hash,
         });
     }
     let task = JudgeTask {
@@ -1086,6 +1093,14 @@ async fn submit(
         time_limit: problem_limits.time_limit,
         memory_limit: problem_limits.mem_limit,
         test_cases,
+        checker: Checker::default(),
+        stop_on_failure: false,
+        // contest submissions are only taken while the contest runs
+        priority: match contest_id {
+            Some(_) => Priority::ContestLive,
+            None => Priority::Normal,
+        },
+        user_id: claims.sub,
     };
     let state_clone = state.clone();
     tokio::spawn(async move {
@@ -1366,6 +1381,9 @@ async fn list_submissions(
 pub(crate) struct TestCaseResultItem {
     test_case_id: i32,
     result: TestCaseJudgeResult,
+    time_us: Option<i64>,         // cpu, user + sys
+    wall_time_us: Option<i64>,    // us
+    mem_consumption: Option<i32>, // KB
 }
 
 #[derive(Serialize, Deserialize, ToSchema)]
@@ -1434,7 +1452,8 @@ async fn get_submission(
 
     let test_case_results = sqlx::query!(
         r#"
-        SELECT test_case_id, result as "result: TestCaseJudgeResult"
+        SELECT test_case_id, result as "result: TestCaseJudgeResult",
+               time_us, wall_time_us, mem_consumption
         FROM submission_test_cases
         WHERE submission_id = $1
         ORDER BY test_case_id
@@ -1448,6 +1467,9 @@ async fn get_submission(
     .map(|row| TestCaseResultItem {
         test_case_id: row.test_case_id,
         result: row.result,
+        time_us: row.time_us,
+        wall_time_us: row.wall_time_us,
+        mem_consumption: row.mem_consumption,
     })
     .collect();
 
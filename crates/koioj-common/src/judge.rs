@@ -1,5 +1,6 @@
 use core::fmt;
 use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
 use std::str::FromStr;
 use utoipa::ToSchema;
 
@@ -52,11 +53,27 @@ pub struct JudgeInfo {
     pub languages: Vec<Language>,
 }
 
-#[derive(Clone, Serialize, Deserialize, Debug)]
+#[derive(Clone, Serialize, Deserialize, Debug, Default)]
 pub struct JudgeLoad {
     pub running_tasks: u32,
     pub cpu_usage: f32,    // 0.0 - 100.0
     pub memory_usage: f32, // 0.0 - 100.0
+    /// Concurrent sandbox runs the judge is sized for.
+    #[serde(default)]
+    pub sandbox_slots: u32,
+    #[serde(default)]
+    pub free_slots: u32,
+    /// Test cases of the accepted tasks not judged yet, waiting ones included.
+    #[serde(default)]
+    pub queued_tests: u32,
+    /// Sandbox runs per second since the previous ping.
+    #[serde(default)]
+    pub runs_per_sec: f32,
+    /// 99th percentiles since the previous ping, in microseconds.
+    #[serde(default)]
+    pub setup_p99_us: u64,
+    #[serde(default)]
+    pub queue_wait_p99_us: u64,
 }
 
 #[derive(Clone, Serialize, Deserialize, Debug)]
@@ -64,6 +81,9 @@ pub struct JudgeLoad {
 pub enum ApiToJudgeMessage {
     #[serde(rename = "judge_task")]
     JudgeTask(JudgeTask),
+    /// Reply to `FetchTestCases`, one message per test case.
+    #[serde(rename = "test_cases")]
+    TestCases(Vec<TestCase>),
     #[serde(rename = "pong")]
     Pong,
 }
@@ -75,7 +95,45 @@ pub struct JudgeTask {
     pub code: String,
     pub time_limit: i32,   // ms
     pub memory_limit: i32, // MB
-    pub test_cases: Vec<TestCase>,
+    pub test_cases: Vec<TestCaseRef>,
+    #[serde(default)]
+    pub checker: Checker,
+    /// Stop at the first test case that isn't accepted, as in ICPC-style
+    /// judging. The remaining test cases are not judged nor reported.
+    #[serde(default)]
+    pub stop_on_failure: bool,
+    #[serde(default)]
+    pub priority: Priority,
+    /// Submitter, whose tasks share the judge fairly with other users'.
+    #[serde(default)]
+    pub user_id: i32,
+}
+
+/// Scheduling class of a task on the judge, higher ones go first.
+#[derive(
+    Clone, Copy, Serialize, Deserialize, Debug, Default, PartialEq, Eq, PartialOrd, Ord, Hash,
+)]
+#[serde(rename_all = "snake_case")]
+pub enum Priority {
+    /// Rejudges and other bulk work, judged with the capacity left over.
+    Background,
+    #[default]
+    Normal,
+    /// Submissions to a running contest.
+    ContestLive,
+}
+
+/// How the judge compares program output with the expected output.
+#[derive(Clone, Copy, Serialize, Deserialize, Debug, Default, PartialEq)]
+#[serde(tag = "mode", rename_all = "snake_case")]
+pub enum Checker {
+    /// Byte exact, ignoring leading and trailing whitespace.
+    #[default]
+    Exact,
+    /// Whitespace separated tokens, any run of whitespace matches any other.
+    Token,
+    /// Like `Token`, numbers match within an absolute or relative epsilon.
+    Float { epsilon: f64 },
 }
 
 #[derive(Clone, Serialize, Deserialize, Debug)]
@@ -84,6 +142,14 @@ pub struct TestCase {
     pub data: TestCaseData,
 }
 
+/// A test case of a task. Judges cache test data by content hash and fetch
+/// only what they don't have.
+#[derive(Clone, Serialize, Deserialize, Debug)]
+pub struct TestCaseRef {
+    pub id: i32,
+    pub hash: String,
+}
+
 #[derive(Debug, Clone, Serialize, Deserialize, ToSchema)]
 #[serde(rename_all = "camelCase")]
 pub struct TestCaseData {
@@ -91,6 +157,17 @@ pub struct TestCaseData {
     pub output: String,
 }
 
+impl TestCaseData {
+    /// Hex sha256 of the input and output, the key judges cache the data under.
+    pub fn hash(&self) -> String {
+        let mut hasher = Sha256::new();
+        hasher.update((self.input.len() as u64).to_le_bytes());
+        hasher.update(&self.input);
+        hasher.update(&self.output);
+        format!("{:x}", hasher.finalize())
+    }
+}
+
 #[derive(Clone, Serialize, Deserialize, Debug)]
 #[serde(tag = "type", content = "payload")]
 pub enum JudgeToApiMessage {
@@ -98,6 +175,9 @@ pub enum JudgeToApiMessage {
     JudgeResult(JudgeResult),
     #[serde(rename = "judge_progress")]
     JudgeProgress(JudgeProgress),
+    /// Test cases a judge is missing in its cache, by id.
+    #[serde(rename = "fetch_test_cases")]
+    FetchTestCases(Vec<i32>),
     #[serde(rename = "ping")]
     Ping(JudgeLoad),
     #[serde(rename = "register")]
@@ -112,14 +192,29 @@ pub struct JudgeResult {
     pub result: SubmissionResult,
     pub time_consumption: i32,   // ms
     pub memory_consumption: i32, // KB
+    /// Results not streamed through `JudgeProgress` already.
     pub test_results: Vec<TestCaseResult>,
 }
 
+impl JudgeResult {
+    /// Folds in the result of another part of the same submission, judged on
+    /// its own.
+    pub fn merge(&mut self, other: JudgeResult) {
+        self.result = SubmissionResult::merge([self.result, other.result]);
+        self.time_consumption += other.time_consumption;
+        self.memory_consumption = self.memory_consumption.max(other.memory_consumption);
+        self.test_results.extend(other.test_results);
+    }
+}
+
 #[derive(Clone, Serialize, Deserialize, Debug)]
 pub struct JudgeProgress {
     pub submission_id: i32,
     pub completed_tests: u32,
     pub total_tests: u32,
+    /// Results finished since the previous progress message.
+    #[serde(default)]
+    pub test_results: Vec<TestCaseResult>,
 }
 
 #[derive(PartialEq, Clone, Copy, Debug, sqlx::Type, Serialize, Deserialize, ToSchema)]
@@ -132,11 +227,46 @@ pub enum SubmissionResult {
     WrongAnswer,
     TimeLimitExceeded,
     MemoryLimitExceeded,
+    OutputLimitExceeded,
     RuntimeError,
     CompileError,
     UnknownError,
 }
 
+impl SubmissionResult {
+    /// Verdict of a submission from those of its test cases, the worst kind
+    /// of failure wins.
+    pub fn from_tests<'a>(results: impl IntoIterator<Item = &'a TestCaseJudgeResult>) -> Self {
+        Self::merge(results.into_iter().map(|r| match r {
+            TestCaseJudgeResult::Accepted => SubmissionResult::Accepted,
+            TestCaseJudgeResult::WrongAnswer => SubmissionResult::WrongAnswer,
+            TestCaseJudgeResult::TimeLimitExceeded => SubmissionResult::TimeLimitExceeded,
+            TestCaseJudgeResult::MemoryLimitExceeded => SubmissionResult::MemoryLimitExceeded,
+            TestCaseJudgeResult::OutputLimitExceeded => SubmissionResult::OutputLimitExceeded,
+            _ => SubmissionResult::RuntimeError,
+        }))
+    }
+
+    /// Verdict of a submission judged in parts. Merging the parts of parts
+    /// gives the same as merging them all at once.
+    pub fn merge(results: impl IntoIterator<Item = SubmissionResult>) -> Self {
+        results
+            .into_iter()
+            .max_by_key(|r| match r {
+                SubmissionResult::Accepted => 0,
+                SubmissionResult::RuntimeError => 1,
+                SubmissionResult::OutputLimitExceeded => 2,
+                SubmissionResult::MemoryLimitExceeded => 3,
+                SubmissionResult::TimeLimitExceeded => 4,
+                SubmissionResult::WrongAnswer => 5,
+                SubmissionResult::Pending => 6,
+                SubmissionResult::CompileError => 7,
+                SubmissionResult::UnknownError => 8,
+            })
+            .unwrap_or(SubmissionResult::Accepted)
+    }
+}
+
 #[derive(PartialEq, Clone, Debug, sqlx::Type, Serialize, Deserialize, ToSchema)]
 #[sqlx(type_name = "test_case_result_enum")]
 #[sqlx(rename_all = "snake_case")]
@@ -149,6 +279,7 @@ pub enum TestCaseJudgeResult {
     WrongAnswer,
     TimeLimitExceeded,
     MemoryLimitExceeded,
+    OutputLimitExceeded,
     RuntimeError,
     CompileError,
     UnknownError,
@@ -158,6 +289,16 @@ pub enum TestCaseJudgeResult {
 pub struct TestCaseResult {
     pub test_case_id: i32,
     pub result: TestCaseJudgeResult,
-    pub time_consumption: i32,
-    pub memory_consumption: i32,
+    pub time_consumption: i32,   // ms
+    pub memory_consumption: i32, // KB
+    /// CPU time, user and system, in microseconds.
+    #[serde(default)]
+    pub time_us: i64,
+    /// Wall time in microseconds.
+    #[serde(default)]
+    pub wall_time_us: i64,
+    /// Startup time of the language's runtime, in microseconds, already taken
+    /// off `time_us` and added to the time limit.
+    #[serde(default)]
+    pub baseline_us: i64,
 }
@@ -9,9 +9,18 @@ fn main() {
         .unwrap()
         .to_path_buf();
 
-    let src_path = "src/judger.cpp";
-    let bin_name = "judger";
-    let bin_path = Path::new(&out_dir).join(bin_name);
+    compile(&out_dir, "src/judger.cpp", "judger", &[]);
+    // sandbox overhead benchmark, see the usage at the top of the source
+    compile(
+        &out_dir,
+        "src/judger_bench.cpp",
+        "judger_bench",
+        &["-pthread"],
+    );
+}
+
+fn compile(out_dir: &Path, src_path: &str, bin_name: &str, extra_args: &[&str]) {
+    let bin_path = out_dir.join(bin_name);
 
     let status = Command::new("g++")
         .args(&[
@@ -23,11 +32,12 @@ fn main() {
             "-Wall",
             "-static-libstdc++",
         ])
+        .args(extra_args)
         .status()
         .expect("Failed to execute g++");
 
     if !status.success() {
-        panic!("Compilation of judger.cpp failed");
+        panic!("Compilation of {} failed", src_path);
     }
 
     println!("cargo:rerun-if-changed={}", src_path);
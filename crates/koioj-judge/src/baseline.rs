@@ -0,0 +1,64 @@
+// koioj-judge/src/baseline.rs
+
+use std::{collections::HashMap, future::Future};
+
+use koioj_common::judge::Language;
+use tokio::sync::{Mutex, OnceCell};
+
+use crate::config::Config;
+
+const DEFAULT_BASELINE_MAX_MS: i64 = 1000;
+
+/// CPU time a language's runtime takes to start and exit, e.g. booting the
+/// JVM, measured once per language on first use. It is part of no submission,
+/// so runs get it on top of their time limit and have it taken off their time.
+pub struct RuntimeBaselines {
+    /// The measurement and its cap, both in microseconds.
+    languages: HashMap<Language, (OnceCell<i64>, i64)>,
+    /// One measurement at a time, so that they don't skew each other.
+    measuring: Mutex<()>,
+}
+
+impl RuntimeBaselines {
+    /// Only languages with a baseline program are measured.
+    pub fn new(config: &Config) -> Self {
+        Self {
+            languages: config
+                .languages
+                .iter()
+                .filter(|(_, lang_config)| lang_config.baseline.is_some())
+                .map(|(lang, lang_config)| {
+                    let max_ms = lang_config
+                        .baseline_max
+                        .map_or(DEFAULT_BASELINE_MAX_MS, i64::from);
+                    (*lang, (OnceCell::new(), max_ms * 1000))
+                })
+                .collect(),
+            measuring: Mutex::new(()),
+        }
+    }
+
+    /// Baseline of `lang` in microseconds, from `measure` the first time.
+    pub async fn get(&self, lang: Language, measure: impl Future<Output = i64>) -> i64 {
+        let Some((cell, max_us)) = self.languages.get(&lang) else {
+            return 0;
+        };
+        *cell
+            .get_or_init(|| async {
+                let _guard = self.measuring.lock().await;
+                let us = measure.await;
+                if us > *max_us {
+                    tracing::warn!(
+                        "{} runtime baseline of {}us is over its maximum, using {}us",
+                        lang,
+                        us,
+                        max_us
+                    );
+                    return *max_us;
+                }
+                tracing::info!("{} runtime baseline: {}us", lang, us);
+                us
+            })
+            .await
+    }
+}
@@ -0,0 +1,134 @@
+// koioj-judge/src/compile_cache.rs
+
+use std::{
+    collections::HashMap,
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex},
+};
+
+use koioj_common::{error::Result, judge::Language};
+use sha2::{Digest, Sha256};
+use uuid::Uuid;
+
+/// A compiled binary on the host, removed once neither the cache nor a
+/// running submission holds it.
+pub struct Artifact {
+    path: PathBuf,
+}
+
+impl Artifact {
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+}
+
+impl Drop for Artifact {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.path);
+    }
+}
+
+#[derive(Clone)]
+pub enum Compiled {
+    Artifact(Arc<Artifact>),
+    /// The compiler rejected the source.
+    Error,
+}
+
+struct Entries {
+    map: HashMap<String, (Compiled, u64)>,
+    tick: u64,
+}
+
+/// LRU of compile outcomes keyed by language, compile command and source, so
+/// resubmitted and template code skips the sandboxed compile.
+pub struct CompileCache {
+    dir: PathBuf,
+    capacity: usize,
+    entries: Mutex<Entries>,
+}
+
+impl CompileCache {
+    /// Nothing of a previous run is known, so `dir` starts out empty.
+    pub fn new(dir: PathBuf, capacity: usize) -> std::io::Result<Self> {
+        match std::fs::remove_dir_all(&dir) {
+            Err(e) if e.kind() != std::io::ErrorKind::NotFound => return Err(e),
+            _ => {}
+        }
+        std::fs::create_dir_all(&dir)?;
+        Ok(Self {
+            dir: std::path::absolute(dir)?,
+            capacity,
+            entries: Mutex::new(Entries {
+                map: HashMap::new(),
+                tick: 0,
+            }),
+        })
+    }
+
+    pub fn key(lang: Language, source: &str, compile_cmd: &[String], code: &str) -> String {
+        let mut hasher = Sha256::new();
+        hasher.update(lang.to_string());
+        hasher.update([0]);
+        hasher.update(source);
+        for arg in compile_cmd {
+            hasher.update([0]);
+            hasher.update(arg);
+        }
+        hasher.update([0]);
+        hasher.update(code);
+        format!("{:x}", hasher.finalize())
+    }
+
+    pub fn get(&self, key: &str) -> Option<Compiled> {
+        let mut entries = self.entries.lock().unwrap();
+        entries.tick += 1;
+        let tick = entries.tick;
+        entries.map.get_mut(key).map(|(compiled, used)| {
+            *used = tick;
+            compiled.clone()
+        })
+    }
+
+    /// Takes over a freshly compiled binary, moving it into the cache unless
+    /// the cache is disabled.
+    pub async fn insert_artifact(&self, key: &str, path: PathBuf) -> Result<Arc<Artifact>> {
+        if self.capacity == 0 {
+            return Ok(Arc::new(Artifact { path }));
+        }
+        // unique, a concurrent compile of the same key may replace the entry
+        // while the artifact it held is still in use
+        let cached = self.dir.join(format!("{}_{}", key, Uuid::new_v4()));
+        if let Err(e) = tokio::fs::rename(&path, &cached).await {
+            let _ = tokio::fs::remove_file(&path).await;
+            return Err(e.into());
+        }
+        let artifact = Arc::new(Artifact { path: cached });
+        self.insert(key, Compiled::Artifact(artifact.clone()));
+        Ok(artifact)
+    }
+
+    pub fn insert_error(&self, key: &str) {
+        if self.capacity > 0 {
+            self.insert(key, Compiled::Error);
+        }
+    }
+
+    fn insert(&self, key: &str, compiled: Compiled) {
+        let mut entries = self.entries.lock().unwrap();
+        entries.tick += 1;
+        let tick = entries.tick;
+        // artifacts still bound by running submissions stay until those end
+        if !entries.map.contains_key(key) && entries.map.len() >= self.capacity {
+            let oldest = entries
+                .map
+                .iter()
+                .min_by_key(|(_, (_, used))| *used)
+                .map(|(key, _)| key.clone());
+            if let Some(oldest) = oldest {
+                entries.map.remove(&oldest);
+            }
+        }
+        entries.map.insert(key.to_string(), (compiled, tick));
+    }
+}
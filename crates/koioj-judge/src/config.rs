@@ -2,8 +2,8 @@
 
 use std::{collections::HashMap, path::PathBuf};
 
-use serde::Deserialize;
 use koioj_common::{judge::Language, utils::deserialize_log_level};
+use serde::Deserialize;
 use tracing::Level;
 
 use crate::sandbox::LanguageConfig;
@@ -18,8 +18,43 @@ pub struct Config {
     pub log_level: Level,
     pub private_key_path: String,
     pub judger_bin_path: PathBuf,
+    /// Number of persistent judger daemons, i.e. concurrent sandbox runs.
+    /// Defaults to the number of available CPUs.
+    pub judger_pool_size: Option<usize>,
+    /// Cores reserved for sandboxes, one per concurrent run. Defaults to the
+    /// online CPUs less `housekeepingCpus`, an empty list disables pinning.
+    pub judge_cpus: Option<Vec<usize>>,
+    /// Cores left to the judge itself, the API, interrupts and the rest of the
+    /// system when `judgeCpus` is unset, since runs timed on them aren't
+    /// comparable to the others. Defaults to CPU 0.
+    pub housekeeping_cpus: Option<Vec<usize>>,
+    /// Output limit of a test run in bytes, stdout included. Defaults to 64 MiB.
+    pub output_limit: Option<i64>,
+    /// Test cases run in sequence in one sandbox, which saves the sandbox
+    /// setup for problems with many small tests. Defaults to 1.
+    pub batch_size: Option<usize>,
+    /// Batches of one submission judged at once, so a submission with many
+    /// tests leaves sandboxes to the others. Defaults to 4.
+    pub test_parallelism: Option<usize>,
+    /// Stop every submission at its first failed test case, not only those
+    /// asking for it.
+    pub stop_on_failure: Option<bool>,
+    /// Compile outcomes kept for identical sources, compile errors included.
+    /// Defaults to 256, 0 disables the cache.
+    pub compile_cache_size: Option<usize>,
+    /// Bytes of test data kept on disk. Beyond it the least recently used is
+    /// removed, unless a running submission uses it. Defaults to 4 GiB.
+    pub testdata_cache_size: Option<u64>,
+    /// Memory limits as a hard wall: no throttling below them and no swap, the
+    /// first OOM ends the run. Page cache is not billed either way.
+    pub strict_memory: Option<bool>,
+    /// Address to serve Prometheus metrics on, disabled if unset.
+    pub metrics_listen: Option<String>,
     pub rootfs_path: PathBuf,
     pub cgroup_base: PathBuf,
+    /// Host directory for compiled artifacts and cached test data shared with
+    /// test sandboxes.
+    pub work_dir: PathBuf,
     pub languages: HashMap<Language, LanguageConfig>,
     pub rootfs_base: String,
     pub rootfs_install: Vec<String>,
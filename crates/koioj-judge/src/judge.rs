@@ -1,35 +1,100 @@
+use crate::baseline::RuntimeBaselines;
+use crate::compile_cache::{Artifact, CompileCache, Compiled};
 use crate::config::Config;
-use crate::judger::{FileInput, JudgerResult, run_judger_async};
-use futures::future::join_all;
+use crate::judger::{
+    FileInput, JudgerPool, JudgerRequest, JudgerResult, OutputFile, RunInput, SyscallFilter,
+    Verdict, online_cpus,
+};
+use crate::metrics::NODE_COUNTERS;
+use crate::sandbox::LanguageConfig;
+use crate::scheduler::{Scheduler, Ticket};
+use crate::testdata::TestDataCache;
+use futures::{StreamExt, stream};
 use koioj_common::judge::{
-    JudgeLoad, JudgeResult, JudgeToApiMessage, Language, SubmissionResult, TestCase,
-    TestCaseJudgeResult, TestCaseResult,
+    Checker, JudgeLoad, JudgeProgress, JudgeResult, JudgeToApiMessage, Language, SubmissionResult,
+    TestCaseJudgeResult, TestCaseRef, TestCaseResult,
 };
+use std::path::PathBuf;
 use std::sync::Arc;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::time::Instant;
 use std::vec;
 use sysinfo::System;
-use tokio::sync::{RwLock, Semaphore};
+use uuid::Uuid;
+
+/// Load figures kept by the running tasks and the load sampler, read without
+/// locks on every ping.
+#[derive(Default)]
+struct LoadCounters {
+    running_tasks: AtomicU32,
+    queued_tests: AtomicU32,
+    /// Bits of the sampled usage in percent, an f32.
+    cpu_usage: AtomicU32,
+    memory_usage: AtomicU32,
+    /// Microseconds from the executor's start to the previous report.
+    last_report_us: AtomicU64,
+}
 
 pub struct JudgeExecutor {
     config: Config,
-    running_tasks: Arc<RwLock<u32>>,
-    semaphore: Arc<Semaphore>,
-
-    system_info: Arc<RwLock<System>>,
-    cached_load: Arc<RwLock<JudgeLoad>>,
+    load: Arc<LoadCounters>,
+    started: Instant,
+    /// Tasks judged at once, the others wait in line by their ticket.
+    scheduler: Arc<Scheduler>,
+    judger_pool: Arc<JudgerPool>,
+    testdata: Arc<TestDataCache>,
+    compile_cache: Arc<CompileCache>,
+    baselines: Arc<RuntimeBaselines>,
 }
 impl JudgeExecutor {
-    pub fn new(config: Config) -> Self {
+    pub fn new(
+        config: Config,
+        testdata: Arc<TestDataCache>,
+        compile_cache: Arc<CompileCache>,
+    ) -> Self {
+        // one sandbox per reserved core, an empty list runs unpinned
+        let cpus = config.judge_cpus.clone().unwrap_or_else(|| {
+            let housekeeping = config.housekeeping_cpus.clone().unwrap_or(vec![0]);
+            online_cpus()
+                .into_iter()
+                .filter(|cpu| !housekeeping.contains(cpu))
+                .collect()
+        });
+        let mut pool_size = config.judger_pool_size.unwrap_or_else(|| {
+            if cpus.is_empty() {
+                std::thread::available_parallelism()
+                    .map(|n| n.get())
+                    .unwrap_or(1)
+            } else {
+                cpus.len()
+            }
+        });
+        if !cpus.is_empty() && pool_size > cpus.len() {
+            tracing::warn!(
+                "judgerPoolSize {} exceeds the {} judge cpus, capping it",
+                pool_size,
+                cpus.len()
+            );
+            pool_size = cpus.len();
+        }
+        let baselines = Arc::new(RuntimeBaselines::new(&config));
+        let judger_pool = Arc::new(JudgerPool::new(
+            config.judger_bin_path.to_string_lossy().to_string(),
+            pool_size,
+            config.rootfs_path.to_string_lossy().to_string(),
+            config.cgroup_base.to_string_lossy().to_string(),
+            &cpus,
+        ));
+
         let executor = Self {
             config,
-            running_tasks: Arc::new(RwLock::new(0)),
-            semaphore: Arc::new(Semaphore::new(64)),
-            system_info: Arc::new(RwLock::new(System::new_all())),
-            cached_load: Arc::new(RwLock::new(JudgeLoad {
-                running_tasks: 0,
-                cpu_usage: 0.0,
-                memory_usage: 0.0,
-            })),
+            load: Arc::new(LoadCounters::default()),
+            started: Instant::now(),
+            scheduler: Scheduler::new(64),
+            judger_pool,
+            testdata,
+            compile_cache,
+            baselines,
         };
 
         executor.spawn_load_updater();
@@ -37,12 +102,11 @@ impl JudgeExecutor {
     }
 
     fn spawn_load_updater(&self) {
-        let system_info = self.system_info.clone();
-        let cached_load = self.cached_load.clone();
-        let running_tasks = self.running_tasks.clone();
+        let load = self.load.clone();
         tokio::spawn(async move {
+            // nobody else reads it, so the sleep in between holds no one up
+            let mut sys = System::new_all();
             loop {
-                let mut sys = system_info.write().await;
                 sys.refresh_cpu_all();
                 sys.refresh_memory();
 
@@ -52,44 +116,69 @@ impl JudgeExecutor {
                 let cpu_usage = sys.cpus().iter().map(|cpu| cpu.cpu_usage()).sum::<f32>()
                     / sys.cpus().len() as f32;
                 let memory_usage = (sys.used_memory() as f32 / sys.total_memory() as f32) * 100.0;
-                drop(sys);
-                let running = *running_tasks.read().await;
-
-                *cached_load.write().await = JudgeLoad {
-                    running_tasks: running,
-                    cpu_usage,
-                    memory_usage,
-                };
+
+                load.cpu_usage.store(cpu_usage.to_bits(), Ordering::Relaxed);
+                load.memory_usage
+                    .store(memory_usage.to_bits(), Ordering::Relaxed);
                 tokio::time::sleep(tokio::time::Duration::from_secs(1)).await;
             }
         });
     }
 
-    pub async fn get_load(&self) -> JudgeLoad {
-        self.cached_load.read().await.clone()
+    /// The sampled CPU and memory usage with the sandbox and queue counts as
+    /// of now, which is what the API schedules on. The rates and percentiles
+    /// cover the time since the previous call, which only the heartbeat makes.
+    pub fn get_load(&self) -> JudgeLoad {
+        let now_us = self.started.elapsed().as_micros() as u64;
+        let since_us = now_us - self.load.last_report_us.swap(now_us, Ordering::Relaxed);
+        let runs = NODE_COUNTERS.runs.swap(0, Ordering::Relaxed);
+        JudgeLoad {
+            running_tasks: self.load.running_tasks.load(Ordering::Relaxed),
+            cpu_usage: f32::from_bits(self.load.cpu_usage.load(Ordering::Relaxed)),
+            memory_usage: f32::from_bits(self.load.memory_usage.load(Ordering::Relaxed)),
+            sandbox_slots: self.judger_pool.size() as u32,
+            free_slots: self.judger_pool.free_slots() as u32,
+            queued_tests: self.load.queued_tests.load(Ordering::Relaxed),
+            runs_per_sec: runs as f32 * 1e6 / since_us.max(1) as f32,
+            setup_p99_us: NODE_COUNTERS.setup.take_p99(),
+            queue_wait_p99_us: NODE_COUNTERS.queue_wait.take_p99(),
+        }
     }
 
+    /// Queues the task and returns, the result is sent through `tx`.
     pub async fn execute_task(
-        &mut self,
+        &self,
         submission_id: i32,
         lang: Language,
         code: String,
         time_limit: i32,
         memory_limit: i32,
-        test_cases: Vec<TestCase>,
+        test_cases: Vec<TestCaseRef>,
+        checker: Checker,
+        stop_on_failure: bool,
+        ticket: Ticket,
         tx: tokio::sync::mpsc::UnboundedSender<JudgeToApiMessage>,
     ) {
-        let permit = self.semaphore.clone().acquire_owned().await.unwrap();
-
-        {
-            let mut running = self.running_tasks.write().await;
-            *running += 1;
-        }
+        // counted while waiting for a permit too
+        let tests = test_cases.len() as u32;
+        self.load.queued_tests.fetch_add(tests, Ordering::Relaxed);
 
-        let running_tasks = self.running_tasks.clone();
+        let scheduler = self.scheduler.clone();
+        let load = self.load.clone();
         let config = self.config.clone();
+        let judger_pool = self.judger_pool.clone();
+        let testdata = self.testdata.clone();
+        let compile_cache = self.compile_cache.clone();
+        let baselines = self.baselines.clone();
 
         tokio::spawn(async move {
+            let queued_at = Instant::now();
+            let permit = scheduler.acquire(ticket).await;
+            NODE_COUNTERS
+                .queue_wait
+                .record(queued_at.elapsed().as_micros() as u64);
+            load.running_tasks.fetch_add(1, Ordering::Relaxed);
+
             let result = judge_submission(
                 submission_id,
                 lang,
@@ -97,217 +186,475 @@ impl JudgeExecutor {
                 time_limit,
                 memory_limit,
                 test_cases,
+                checker,
+                stop_on_failure,
                 &config,
+                &judger_pool,
+                ticket,
+                &testdata,
+                &compile_cache,
+                &baselines,
+                &tx,
             )
             .await;
 
             let _ = tx.send(result);
 
-            {
-                let mut running = running_tasks.write().await;
-                *running -= 1;
-            }
+            load.running_tasks.fetch_sub(1, Ordering::Relaxed);
+            load.queued_tests.fetch_sub(tests, Ordering::Relaxed);
 
             drop(permit);
         });
     }
 }
 
+/// Bytes of stdout/stderr the judger returns inline, enough for diagnostics.
+const RETURN_LIMIT: i64 = 64 * 1024;
+const DEFAULT_OUTPUT_LIMIT: i64 = 64 * 1024 * 1024;
+const DEFAULT_TEST_PARALLELISM: usize = 4;
+const TMPFS_SIZE: &str = "256M";
+const PIDS_LIMIT: i32 = 16;
+/// Runs of a baseline program, the fastest one counts.
+const BASELINE_RUNS: usize = 3;
+
+fn unknown_error(test_case_id: i32) -> TestCaseResult {
+    TestCaseResult {
+        test_case_id,
+        result: TestCaseJudgeResult::UnknownError,
+        time_consumption: 0,
+        memory_consumption: 0,
+        time_us: 0,
+        wall_time_us: 0,
+        baseline_us: 0,
+    }
+}
+
+/// `baseline_us` is the runtime's own startup time, taken off the run's.
+fn test_case_result(
+    submission_id: i32,
+    test_case_id: i32,
+    res: &JudgerResult,
+    baseline_us: i64,
+) -> TestCaseResult {
+    let result = match res.verdict {
+        Verdict::Ok => TestCaseJudgeResult::Accepted,
+        Verdict::Wa => {
+            tracing::debug!(
+                "Submission {} test {} wrong answer: {}",
+                submission_id,
+                test_case_id,
+                res.checker_message
+            );
+            TestCaseJudgeResult::WrongAnswer
+        }
+        Verdict::Tle => TestCaseJudgeResult::TimeLimitExceeded,
+        Verdict::Mle => TestCaseJudgeResult::MemoryLimitExceeded,
+        Verdict::Ole => TestCaseJudgeResult::OutputLimitExceeded,
+        Verdict::Re => TestCaseJudgeResult::RuntimeError,
+        _ => TestCaseJudgeResult::UnknownError,
+    };
+    let time_us = (res.time_us - baseline_us).max(0);
+    // page cache is the kernel's to drop, not the program's memory
+    let memory_bytes = res.anon_bytes;
+    TestCaseResult {
+        test_case_id,
+        result,
+        time_consumption: (time_us / 1000) as i32,
+        memory_consumption: (memory_bytes / 1024) as i32,
+        time_us,
+        wall_time_us: res.wall_time_us,
+        baseline_us,
+    }
+}
+
+/// Creates `name` under the work dir and returns its absolute path, which is
+/// how the judger sees it from inside its own mount namespace.
+async fn work_subdir(config: &Config, name: &str) -> std::io::Result<PathBuf> {
+    let dir = config.work_dir.join(name);
+    tokio::fs::create_dir_all(&dir).await?;
+    std::path::absolute(dir)
+}
+
+fn compile_error(submission_id: i32) -> JudgeToApiMessage {
+    JudgeToApiMessage::JudgeResult(JudgeResult {
+        submission_id,
+        result: SubmissionResult::CompileError,
+        time_consumption: 0,
+        memory_consumption: 0,
+        test_results: vec![],
+    })
+}
+
+/// Compiles the submission unless an identical source was compiled before.
+/// `Ok(None)` means the compiler produced no artifact, which fails every test.
+async fn compile(
+    submission_id: i32,
+    lang: Language,
+    code: &str,
+    lang_config: &LanguageConfig,
+    compile_cmd: &[String],
+    config: &Config,
+    judger_pool: &JudgerPool,
+    ticket: Ticket,
+    compile_cache: &CompileCache,
+) -> std::result::Result<Option<Arc<Artifact>>, JudgeToApiMessage> {
+    let cache_key = CompileCache::key(lang, &lang_config.source, compile_cmd, code);
+    match compile_cache.get(&cache_key) {
+        Some(Compiled::Artifact(artifact)) => {
+            tracing::debug!("Submission {} compile cache hit", submission_id);
+            return Ok(Some(artifact));
+        }
+        Some(Compiled::Error) => {
+            tracing::debug!("Submission {} compile error, cached", submission_id);
+            return Err(compile_error(submission_id));
+        }
+        None => {}
+    }
+
+    // unique, the same submission may compile twice at once, e.g. resent
+    let compile_id = format!("koioj_judge_{}_{}", submission_id, Uuid::new_v4().simple());
+    let artifact_path = match work_subdir(config, "artifacts").await {
+        Ok(dir) => dir.join(&compile_id).to_string_lossy().to_string(),
+        Err(e) => {
+            return Err(JudgeToApiMessage::Error(
+                submission_id,
+                format!("Failed to create artifact dir: {:?}", e),
+            ));
+        }
+    };
+    let compile_req = JudgerRequest {
+        rootfs: lang_config.rootfs_layers(config),
+        tmpfs_size: TMPFS_SIZE.to_string(),
+        cgroup: config.cgroup_base.to_string_lossy().to_string(),
+        sandbox_id: format!("{}_compile", compile_id),
+        time_limit_ms: 5000,
+        memory_limit_mb: 512,
+        fsize_limit: 512 * 1024 * 1024,
+        return_limit: RETURN_LIMIT,
+        pids_limit: 128,
+        runs: vec![RunInput::default()],
+        checker: Checker::default(),
+        cmdline: compile_cmd.to_vec(),
+        files: vec![FileInput::text(&lang_config.source, code, 0o644)],
+        output_files: vec![OutputFile {
+            filename: lang_config.compiled.clone(),
+            export_path: Some(artifact_path.clone()),
+        }],
+        syscall_filter: SyscallFilter::None,
+        strict_memory: false,
+    };
+    let compile_res = judger_pool
+        .run(&compile_req, ticket)
+        .await
+        .map(|mut results| results.remove(0));
+    match compile_res {
+        Err(e) => Err(JudgeToApiMessage::Error(
+            submission_id,
+            format!("Judger error when compiling: {:?}", e),
+        )),
+        Ok(res) if res.verdict == Verdict::Ok => {
+            // a missing artifact fails every test case with UKE
+            if !tokio::fs::try_exists(&artifact_path).await.unwrap_or(false) {
+                tracing::debug!("Submission {} produced no artifact", submission_id);
+                return Ok(None);
+            }
+            compile_cache
+                .insert_artifact(&cache_key, artifact_path.into())
+                .await
+                .map(Some)
+                .map_err(|e| {
+                    JudgeToApiMessage::Error(
+                        submission_id,
+                        format!("Failed to keep artifact: {:?}", e),
+                    )
+                })
+        }
+        Ok(res) => {
+            tracing::debug!(
+                "Submission {} compile error: {:?}, time {}us",
+                submission_id,
+                res.verdict,
+                res.time_us
+            );
+            // a compiler exiting with an error fails the same way every time,
+            // running out of time or memory may not
+            if res.verdict == Verdict::Re {
+                compile_cache.insert_error(&cache_key);
+            }
+            Err(compile_error(submission_id))
+        }
+    }
+}
+
+/// CPU time of the fastest run of the language's baseline program, 0 if it
+/// doesn't compile or run.
+async fn measure_baseline(
+    lang: Language,
+    code: &str,
+    lang_config: &LanguageConfig,
+    config: &Config,
+    judger_pool: &JudgerPool,
+    ticket: Ticket,
+    compile_cache: &CompileCache,
+) -> i64 {
+    let artifact = match &lang_config.compile {
+        Some(compile_cmd) => match compile(
+            0,
+            lang,
+            code,
+            lang_config,
+            compile_cmd,
+            config,
+            judger_pool,
+            ticket,
+            compile_cache,
+        )
+        .await
+        {
+            Ok(Some(artifact)) => Some(artifact),
+            _ => {
+                tracing::warn!("{} baseline program failed to compile", lang);
+                return 0;
+            }
+        },
+        None => None,
+    };
+    let files = match &artifact {
+        Some(artifact) => vec![FileInput::host(
+            &lang_config.compiled,
+            &artifact.path().to_string_lossy(),
+            0o775,
+        )],
+        None => vec![FileInput::text(&lang_config.source, code, 0o644)],
+    };
+
+    let req = JudgerRequest {
+        rootfs: lang_config.rootfs_layers(config),
+        tmpfs_size: TMPFS_SIZE.to_string(),
+        cgroup: config.cgroup_base.to_string_lossy().to_string(),
+        sandbox_id: format!("koioj_judge_baseline_{}", lang),
+        time_limit_ms: 10_000,
+        memory_limit_mb: 1024,
+        fsize_limit: DEFAULT_OUTPUT_LIMIT,
+        return_limit: RETURN_LIMIT,
+        pids_limit: PIDS_LIMIT,
+        runs: vec![RunInput::default(); BASELINE_RUNS],
+        checker: Checker::default(),
+        cmdline: lang_config.run.clone(),
+        files,
+        output_files: vec![],
+        syscall_filter: lang_config.syscall_filter,
+        strict_memory: false,
+    };
+    let results = judger_pool.run(&req, ticket).await.unwrap_or_default();
+    let baseline = results
+        .iter()
+        .filter(|res| res.verdict == Verdict::Ok)
+        .map(|res| res.time_us)
+        .min();
+    if baseline.is_none() {
+        tracing::warn!("{} baseline program failed to run", lang);
+    }
+    baseline.unwrap_or(0)
+}
+
 async fn judge_submission(
     submission_id: i32,
     lang: Language,
     code: String,
     time_limit: i32,
     memory_limit: i32,
-    test_cases: Vec<TestCase>,
+    test_cases: Vec<TestCaseRef>,
+    checker: Checker,
+    stop_on_failure: bool,
     config: &Config,
+    judger_pool: &JudgerPool,
+    ticket: Ticket,
+    testdata: &TestDataCache,
+    compile_cache: &CompileCache,
+    baselines: &RuntimeBaselines,
+    tx: &tokio::sync::mpsc::UnboundedSender<JudgeToApiMessage>,
 ) -> JudgeToApiMessage {
     let lang_config = config.languages.get(&lang);
 
-    let judger_bin_path = config.judger_bin_path.to_string_lossy().to_string();
-    let rootfs_path = config.rootfs_path.to_string_lossy().to_string();
     let cgroup_base = config.cgroup_base.to_string_lossy().to_string();
-    let tmpfs_size = "256M";
-    let pids_limit = 16;
+    let output_limit = config.output_limit.unwrap_or(DEFAULT_OUTPUT_LIMIT);
 
     if lang_config.is_none() {
         return JudgeToApiMessage::Error(submission_id, format!("Unsupported language {:?}", lang));
     }
     let lang_config = lang_config.unwrap();
+    let rootfs = lang_config.rootfs_layers(config);
 
-    let compile_result: Option<JudgerResult>;
-
-    // compile
-    if let Some(compile_cmd) = &lang_config.compile {
-        match run_judger_async(
-            &judger_bin_path,
-            &rootfs_path,
-            tmpfs_size,
-            &cgroup_base,
-            &format!("koioj_judge_{}_compile", submission_id),
-            5000,
-            512,
-            512 * 1024 * 1024,
-            128,
-            "",
-            &compile_cmd
-                .iter()
-                .map(|s| s.as_str())
-                .collect::<Vec<&str>>(),
-            &[FileInput::text(&lang_config.source, &code, 0o644)],
-            &[&lang_config.compiled],
-        )
-        .await
-        {
-            Err(e) => {
-                return JudgeToApiMessage::Error(
-                    submission_id,
-                    format!("Judger error when compiling: {:?}", e),
-                );
-            }
-            Ok(res) if res.verdict == crate::judger::Verdict::Ok => {
-                compile_result = Some(res);
-            }
-            Ok(res) => {
-                tracing::debug!(
-                    "Submission {} compile error: {:?}, time {}",
-                    submission_id,
-                    res.verdict,
-                    res.time
-                );
-                return JudgeToApiMessage::JudgeResult(JudgeResult {
-                    submission_id,
-                    result: SubmissionResult::CompileError,
-                    time_consumption: 0,
-                    memory_consumption: 0,
-                    test_results: vec![],
-                });
+    // the compiled binary is exported once to the work dir and bound into
+    // every test sandbox, instead of round-tripping through the protocol
+    let artifact = match &lang_config.compile {
+        Some(compile_cmd) => {
+            match compile(
+                submission_id,
+                lang,
+                &code,
+                lang_config,
+                compile_cmd,
+                config,
+                judger_pool,
+                ticket,
+                compile_cache,
+            )
+            .await
+            {
+                Ok(artifact) => artifact,
+                Err(msg) => return msg,
             }
         }
-    } else {
-        compile_result = None;
+        None => None,
+    };
+    let needs_artifact = lang_config.compile.is_some();
+
+    // measured on the first submission of the language, the ones arriving
+    // meanwhile wait for it
+    let baseline_us = match &lang_config.baseline {
+        Some(code) => {
+            baselines
+                .get(
+                    lang,
+                    measure_baseline(
+                        lang,
+                        code,
+                        lang_config,
+                        config,
+                        judger_pool,
+                        ticket,
+                        compile_cache,
+                    ),
+                )
+                .await
+        }
+        None => 0,
+    };
+    let time_limit = time_limit + ((baseline_us + 999) / 1000) as i32;
+    if baseline_us > 0 {
+        tracing::debug!(
+            "Submission {} runtime baseline {}us, time limit {}ms",
+            submission_id,
+            baseline_us,
+            time_limit
+        );
     }
 
-    // test
-    let test_futures = test_cases.iter().map(|test_case| {
+    // test data is passed to the sandbox as cached files, never through the
+    // protocol. compile errors don't get here, so they never fetch any
+    let _held = match testdata.ensure(&test_cases, tx).await {
+        Ok(held) => held,
+        Err(e) => {
+            return JudgeToApiMessage::Error(
+                submission_id,
+                format!("Failed to get test data: {:?}", e),
+            );
+        }
+    };
+
+    // test, every batch of test cases shares one sandbox and runs in sequence
+    let batch_size = config.batch_size.unwrap_or(1).max(1);
+    let test_futures = test_cases.chunks(batch_size).map(|batch| {
         let run_cmd = lang_config.run.clone();
         let compiled = lang_config.compiled.clone();
-        let input = test_case.data.input.clone();
-        let expected_output = test_case.data.output.clone();
-        let test_id = test_case.id;
-        let compile_result_ref = compile_result.as_ref();
-        let rootfs_path = rootfs_path.clone();
-        let judger_bin_path = judger_bin_path.clone();
+        let artifact_ref = artifact
+            .as_ref()
+            .map(|a| a.path().to_string_lossy().to_string());
+        let rootfs = rootfs.clone();
         let cgroup_base = cgroup_base.clone();
         let submission_id = submission_id;
 
         async move {
-            let input_files: Vec<FileInput> = match compile_result_ref {
-                Some(res) => match res.output_files.iter().find(|(name, _)| name == &compiled) {
-                    Some((_, content)) => vec![FileInput {
-                        filename: compiled.clone(),
-                        content: content.to_vec(),
-                        mode: 0o775,
-                    }],
-                    None => {
-                        return TestCaseResult {
-                            test_case_id: test_id,
-                            result: TestCaseJudgeResult::UnknownError,
-                            time_consumption: 0,
-                            memory_consumption: 0,
-                        };
-                    }
-                },
+            let failed = || batch.iter().map(|t| unknown_error(t.id)).collect();
+            let input_files: Vec<FileInput> = match &artifact_ref {
+                Some(path) => vec![FileInput::host(&compiled, path, 0o775)],
+                None if needs_artifact => return failed(),
                 None => vec![],
             };
 
-            let run_result = run_judger_async(
-                &judger_bin_path,
-                &rootfs_path,
-                tmpfs_size,
-                &cgroup_base,
-                &format!("koioj_judge_{}_test_{}", submission_id, test_id),
-                time_limit.into(),
-                memory_limit.into(),
-                32 * 1024,
-                pids_limit,
-                &input,
-                &run_cmd.iter().map(|s| s.as_str()).collect::<Vec<&str>>(),
-                &input_files,
-                &[],
-            )
-            .await;
-
-            match run_result {
-                Err(_) => TestCaseResult {
-                    test_case_id: test_id,
-                    result: TestCaseJudgeResult::UnknownError,
-                    time_consumption: 0,
-                    memory_consumption: 0,
-                },
-                Ok(res) => {
-                    let result = match res.verdict {
-                        crate::judger::Verdict::Ok => {
-                            if res.stdout.trim() == expected_output.trim() {
-                                TestCaseJudgeResult::Accepted
-                            } else {
-                                TestCaseJudgeResult::WrongAnswer
-                            }
-                        }
-                        crate::judger::Verdict::Tle => TestCaseJudgeResult::TimeLimitExceeded,
-                        crate::judger::Verdict::Mle => TestCaseJudgeResult::MemoryLimitExceeded,
-                        crate::judger::Verdict::Re => TestCaseJudgeResult::RuntimeError,
-                        _ => TestCaseJudgeResult::UnknownError,
-                    };
-                    TestCaseResult {
-                        test_case_id: test_id,
-                        result,
-                        time_consumption: res.time,
-                        memory_consumption: res.memory as i32,
+            let runs = batch
+                .iter()
+                .map(|test_case| {
+                    let (stdin_path, answer_path) = testdata.paths(&test_case.hash);
+                    RunInput {
+                        stdin_path: Some(stdin_path.to_string_lossy().to_string()),
+                        answer_path: Some(answer_path.to_string_lossy().to_string()),
+                        ..Default::default()
                     }
-                }
+                })
+                .collect();
+
+            let run_req = JudgerRequest {
+                rootfs,
+                tmpfs_size: TMPFS_SIZE.to_string(),
+                cgroup: cgroup_base,
+                sandbox_id: format!("koioj_judge_{}_test_{}", submission_id, batch[0].id),
+                time_limit_ms: time_limit,
+                memory_limit_mb: memory_limit.into(),
+                fsize_limit: output_limit,
+                return_limit: RETURN_LIMIT,
+                pids_limit: PIDS_LIMIT,
+                runs,
+                checker,
+                cmdline: run_cmd,
+                files: input_files,
+                output_files: vec![],
+                syscall_filter: lang_config.syscall_filter,
+                strict_memory: config.strict_memory.unwrap_or(false),
+            };
+            match judger_pool.run(&run_req, ticket).await.ok() {
+                None => failed(),
+                Some(results) => batch
+                    .iter()
+                    .zip(results)
+                    .map(|(test_case, res)| {
+                        test_case_result(submission_id, test_case.id, &res, baseline_us)
+                    })
+                    .collect::<Vec<_>>(),
             }
         }
     });
 
-    let test_results: Vec<TestCaseResult> = join_all(test_futures).await;
-
-    let final_result = if test_results
-        .iter()
-        .all(|r| r.result == TestCaseJudgeResult::Accepted)
-    {
-        SubmissionResult::Accepted
-    } else if test_results
-        .iter()
-        .any(|r| r.result == TestCaseJudgeResult::WrongAnswer)
-    {
-        SubmissionResult::WrongAnswer
-    } else if test_results
-        .iter()
-        .any(|r| r.result == TestCaseJudgeResult::TimeLimitExceeded)
-    {
-        SubmissionResult::TimeLimitExceeded
-    } else if test_results
-        .iter()
-        .any(|r| r.result == TestCaseJudgeResult::MemoryLimitExceeded)
-    {
-        SubmissionResult::MemoryLimitExceeded
-    } else {
-        SubmissionResult::RuntimeError
-    };
-
-    let total_time = test_results.iter().map(|r| r.time_consumption).sum();
-    let max_memory = test_results
-        .iter()
-        .map(|r| r.memory_consumption)
-        .max()
-        .unwrap_or(0);
+    // batches complete in order, so stopping keeps the first failure. dropping
+    // the stream cancels pending batches and kills the in-flight judgers
+    let parallelism = config
+        .test_parallelism
+        .unwrap_or(DEFAULT_TEST_PARALLELISM)
+        .max(1);
+    let stop_on_failure = stop_on_failure || config.stop_on_failure.unwrap_or(false);
+    let mut batches = stream::iter(test_futures.collect::<Vec<_>>()).buffered(parallelism);
+    // results go out per batch as progress, only what the verdict needs is kept
+    let mut verdicts: Vec<TestCaseJudgeResult> = Vec::with_capacity(test_cases.len());
+    let mut total_time_us: i64 = 0; // summed before rounding to ms
+    let mut max_memory = 0;
+    while let Some(results) = batches.next().await {
+        for r in &results {
+            verdicts.push(r.result.clone());
+            total_time_us += r.time_us;
+            max_memory = max_memory.max(r.memory_consumption);
+        }
+        let failed = results
+            .iter()
+            .any(|r| r.result != TestCaseJudgeResult::Accepted);
+        let _ = tx.send(JudgeToApiMessage::JudgeProgress(JudgeProgress {
+            submission_id,
+            completed_tests: verdicts.len() as u32,
+            total_tests: test_cases.len() as u32,
+            test_results: results,
+        }));
+        if failed && stop_on_failure {
+            break;
+        }
+    }
+    drop(batches);
 
     JudgeToApiMessage::JudgeResult(JudgeResult {
         submission_id,
-        result: final_result,
-        time_consumption: total_time,
+        result: SubmissionResult::from_tests(&verdicts),
+        time_consumption: (total_time_us / 1000) as i32,
         memory_consumption: max_memory,
-        test_results,
+        test_results: vec![],
     })
 }
@@ -6,21 +6,36 @@
 // https://github.com/ParaN3xus/koioj
 // Copyright (C) 2025 ParaN3xus <paran3xus007@gmail.com>
 
+#include <algorithm>
 #include <cerrno>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
+#include <ftw.h>
 #include <iostream>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <poll.h>
 #include <sched.h>
 #include <signal.h>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <vector>
@@ -33,40 +48,119 @@ enum Verdict {
   VERDICT_TLE = 1,
   VERDICT_MLE = 2,
   VERDICT_RE = 3,
-  VERDICT_UKE = 4
+  VERDICT_UKE = 4,
+  VERDICT_WA = 5,
+  VERDICT_OLE = 6
+};
+
+enum CheckMode {
+  CHECK_NONE = 0,
+  CHECK_EXACT = 1,
+  CHECK_TOKEN = 2,
+  CHECK_FLOAT = 3
+};
+
+enum FileKind { FILE_INLINE = 0, FILE_HOST = 1 };
+
+// seccomp profile of the program
+enum SyscallFilter {
+  FILTER_NONE = 0,
+  FILTER_NATIVE = 1,  // allowlist for compiled programs
+  FILTER_RUNTIME = 2, // denylist for interpreters and vms, threads only
+  FILTER_COUNT
 };
 
 struct FileInfo {
   std::string filename;
   std::vector<char> content;
   int mode;
+  std::string host_path; // FILE_HOST, placed by reference instead of content
+};
+
+struct OutputFile {
+  std::string filename;
+  std::string export_path; // copied to this host path instead of returned
+};
+
+struct RunInput {
+  std::string stdin_content;
+  std::string stdin_path;  // host file handed to the executor as fd 0
+  std::string stdout_path; // host file the executor writes as fd 1
+  std::string answer_path;
 };
 
 struct JudgeConfig {
   int time_limit;         // ms
   long long memory_limit; // MB
-  long long fsize_limit;
+  long long fsize_limit;  // bytes, also the output limit
+  long long return_limit; // bytes of stdout/stderr returned inline
   int pids_limit;
-  std::string rootfs;
+  std::vector<std::string> rootfs; // layers, the first on top
   std::string tmpfs_size;
   std::string cgroup;
   std::string sandbox_id;
-  std::string stdin_content;
+  std::vector<RunInput> runs; // run in sequence in the same sandbox
+  int checker;                // CheckMode, stdout is not returned when set
+  double checker_eps;
   std::vector<std::string> cmdline;
   std::vector<FileInfo> input_files;
-  std::vector<std::string> output_filenames;
+  std::vector<OutputFile> output_files;
+  int syscall_filter; // SyscallFilter
+  bool strict_memory; // no memory.high throttling or swap, oom ends the run
+};
+
+// time spent in one phase of a request
+struct Phase {
+  std::string name;
+  long long usec;
 };
 
 struct JudgeResult {
   int verdict;
-  int time;         // ms
-  long long memory; // KB -> MB later
+  long long time_us;      // cpu, user + sys, from execve on
+  long long wall_us;      // from exec to exit
+  long long memory_bytes; // peak
+  long long anon_bytes;   // program's own, at its sampled peak
+  long long file_bytes;   // page cache, in the same sample
   std::string stdout_content;
   std::string stderr_content;
+  std::string checker_message; // where the output went wrong
   std::vector<FileInfo> output_files;
+  std::vector<Phase> phases; // the first run also gets the sandbox setup
 };
 
 // utils
+long long now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long long cpu_us(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// each mark records the time since the previous one
+struct PhaseTimer {
+  std::vector<Phase> &phases;
+  long long last;
+
+  PhaseTimer(std::vector<Phase> &phases, long long start)
+      : phases(phases), last(start) {}
+
+  // at is a timestamp taken elsewhere, a phase that never got one is skipped
+  void mark(const char *name, long long at = -1) {
+    if (at < 0)
+      at = now_us();
+    if (at < last)
+      return;
+    phases.push_back({name, at - last});
+    last = at;
+  }
+};
+
 void write_full(int fd, const void *buf, size_t size) {
   size_t total = 0;
   while (total < size) {
@@ -85,7 +179,7 @@ void read_full(int fd, void *buf, size_t size) {
   while (total < size) {
     ssize_t ret = read(fd, (char *)buf + total, size - total);
     if (ret <= 0) {
-      if (errno == EINTR)
+      if (ret < 0 && errno == EINTR)
         continue;
       throw std::runtime_error("Read failed or EOF");
     }
@@ -93,29 +187,223 @@ void read_full(int fd, void *buf, size_t size) {
   }
 }
 
-// proto
-std::string read_proto_str(int fd) {
-  int len;
-  read_full(fd, &len, sizeof(int));
-  if (len == 0)
-    return "";
-  std::string s(len, '\0');
-  read_full(fd, &s[0], len);
-  return s;
+// like read_full, but returns false on eof before the first byte
+bool read_full_or_eof(int fd, void *buf, size_t size) {
+  ssize_t ret;
+  do {
+    ret = read(fd, buf, size);
+  } while (ret < 0 && errno == EINTR);
+  if (ret == 0)
+    return false;
+  if (ret < 0)
+    throw std::runtime_error("Read failed");
+  if ((size_t)ret < size)
+    read_full(fd, (char *)buf + ret, size - ret);
+  return true;
+}
+
+// proto, every message is one frame: a fixed header, then the payload.
+// lengths in the payload are 64-bit so outputs over 2GB can't overflow them
+const uint32_t PROTO_MAGIC = 0x504a4f4b; // "KOJP"
+const uint16_t PROTO_VERSION = 6;
+const uint64_t PROTO_MAX_PAYLOAD = 1ULL << 32;
+
+enum MessageType {
+  MSG_REQUEST = 1, // one JudgeConfig
+  MSG_RESULT = 2,  // one JudgeResult, sent as each run finishes
+  MSG_DONE = 3,    // all runs reported
+  MSG_ERROR = 4,   // the request failed as a whole, ends it as well
+};
+
+struct FrameHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t type;
+  uint64_t length;
+};
+static_assert(sizeof(FrameHeader) == 16, "frame header is 16 bytes");
+
+// the stream can't be resynced, e.g. a frame was cut short
+struct ProtocolError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// large blobs are only referenced, they must outlive the write
+struct Encoder {
+  struct Ref {
+    size_t at; // offset in buf the blob goes after
+    const char *data;
+    size_t size;
+  };
+  std::string buf;
+  std::vector<Ref> refs;
+
+  size_t size() const {
+    size_t n = buf.size();
+    for (const auto &r : refs)
+      n += r.size;
+    return n;
+  }
+  void put(const void *p, size_t n) { buf.append((const char *)p, n); }
+  void i32(int v) { put(&v, sizeof(int)); }
+  void i64(long long v) { put(&v, sizeof(long long)); }
+  void str(const std::string &s) {
+    i64(s.size());
+    buf += s;
+  }
+  void bytes(const std::vector<char> &b) {
+    i64(b.size());
+    put(b.data(), b.size());
+  }
+  void ref(const char *data, size_t n) {
+    i64(n);
+    refs.push_back({buf.size(), data, n});
+  }
+  void ref(const std::string &s) { ref(s.data(), s.size()); }
+  void ref(const std::vector<char> &b) { ref(b.data(), b.size()); }
+};
+
+struct Decoder {
+  const char *p, *end;
+
+  explicit Decoder(const std::string &s)
+      : p(s.data()), end(s.data() + s.size()) {}
+
+  void get(void *out, size_t n) {
+    if ((size_t)(end - p) < n)
+      throw std::runtime_error("Truncated message");
+    memcpy(out, p, n);
+    p += n;
+  }
+  int i32() {
+    int v;
+    get(&v, sizeof(int));
+    return v;
+  }
+  long long i64() {
+    long long v;
+    get(&v, sizeof(long long));
+    return v;
+  }
+  double f64() {
+    double v;
+    get(&v, sizeof(double));
+    return v;
+  }
+  size_t len() {
+    long long n = i64();
+    if (n > end - p)
+      throw std::runtime_error("Truncated message");
+    return n > 0 ? n : 0;
+  }
+  std::string str() {
+    size_t n = len();
+    std::string s(p, n);
+    p += n;
+    return s;
+  }
+  std::vector<char> bytes() {
+    size_t n = len();
+    std::vector<char> b(p, p + n);
+    p += n;
+    return b;
+  }
+};
+
+// header and payload go out in a single writev, blobs straight from where
+// they are
+void write_frame(int fd, uint16_t type, const Encoder &enc) {
+  FrameHeader h = {PROTO_MAGIC, PROTO_VERSION, type, enc.size()};
+  std::vector<struct iovec> iov = {{&h, sizeof(h)}};
+  size_t at = 0;
+  for (const auto &r : enc.refs) {
+    iov.push_back({(void *)(enc.buf.data() + at), r.at - at});
+    iov.push_back({(void *)r.data, r.size});
+    at = r.at;
+  }
+  iov.push_back({(void *)(enc.buf.data() + at), enc.buf.size() - at});
+
+  size_t idx = 0;
+  while (idx < iov.size()) {
+    ssize_t ret = writev(fd, &iov[idx], std::min<size_t>(iov.size() - idx, 64));
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error("Write failed");
+    }
+    for (; idx < iov.size() && (size_t)ret >= iov[idx].iov_len; ++idx)
+      ret -= iov[idx].iov_len;
+    if (idx < iov.size()) {
+      iov[idx].iov_base = (char *)iov[idx].iov_base + ret;
+      iov[idx].iov_len -= ret;
+    }
+  }
+}
+
+// false on eof before the frame
+bool read_frame_header(int fd, FrameHeader &h) {
+  bool got;
+  try {
+    got = read_full_or_eof(fd, &h, sizeof(h));
+  } catch (const std::exception &) {
+    throw ProtocolError("Truncated frame header");
+  }
+  if (got && (h.magic != PROTO_MAGIC || h.length > PROTO_MAX_PAYLOAD))
+    throw ProtocolError("Bad frame header");
+  return got;
 }
 
-void write_proto_str(int fd, const std::string &s) {
-  int len = s.length();
-  write_full(fd, &len, sizeof(int));
-  if (len > 0)
-    write_full(fd, s.data(), len);
+// one whole frame of the given type. the payload is always consumed, so
+// a frame that is merely unexpected leaves the stream in sync
+bool read_frame(int fd, uint16_t type, std::string &payload) {
+  FrameHeader h;
+  if (!read_frame_header(fd, h))
+    return false;
+  payload.assign(h.length, '\0');
+  try {
+    read_full(fd, &payload[0], h.length);
+  } catch (const std::exception &) {
+    throw ProtocolError("Truncated frame");
+  }
+  if (h.version != PROTO_VERSION)
+    throw std::runtime_error("Unsupported protocol version " +
+                             std::to_string(h.version));
+  if (h.type != type)
+    throw std::runtime_error("Unexpected message type " +
+                             std::to_string(h.type));
+  return true;
+}
+
+void write_result(int fd, const JudgeResult &res) {
+  Encoder enc;
+  enc.i32(res.verdict);
+  enc.i64(res.time_us);
+  enc.i64(res.wall_us);
+  enc.i64(res.memory_bytes);
+  enc.ref(res.stdout_content);
+  enc.ref(res.stderr_content);
+  enc.str(res.checker_message);
+
+  enc.i32(res.output_files.size());
+  for (const auto &f : res.output_files) {
+    enc.str(f.filename);
+    enc.ref(f.content);
+  }
+
+  // optional trailer, readers that stop before it lose nothing else
+  enc.i32(res.phases.size());
+  for (const auto &ph : res.phases) {
+    enc.str(ph.name);
+    enc.i64(ph.usec);
+  }
+  enc.i64(res.anon_bytes);
+  enc.i64(res.file_bytes);
+  write_frame(fd, MSG_RESULT, enc);
 }
 
-void write_proto_buf(int fd, const std::vector<char> &buf) {
-  int len = buf.size();
-  write_full(fd, &len, sizeof(int));
-  if (len > 0)
-    write_full(fd, buf.data(), len);
+void close_pipe(int p[2]) {
+  close(p[0]);
+  close(p[1]);
 }
 
 // file utils
@@ -152,6 +440,50 @@ std::string read_file(const std::string &path) {
   return ss.str();
 }
 
+// at most limit bytes from the start of the file
+std::string read_file_head(const std::string &path, long long limit) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return "";
+  std::string s;
+  char buf[65536];
+  while ((long long)s.size() < limit) {
+    ssize_t n =
+        read(fd, buf, std::min<long long>(sizeof(buf), limit - s.size()));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    s.append(buf, n);
+  }
+  close(fd);
+  return s;
+}
+
+// kill what's left in a cgroup. cgroup.kill needs linux 5.14, without it the
+// processes still die with their pid namespace
+void kill_cgroup(const std::string &path) {
+  int fd = open((path + "/cgroup.kill").c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    write(fd, "1", 1);
+    close(fd);
+  }
+}
+
+// kill what's left in a cgroup and remove it. rmdir is busy until they are
+// reaped
+bool remove_cgroup(const std::string &path) {
+  kill_cgroup(path);
+  for (int i = 0; i < 200; ++i) {
+    if (rmdir(path.c_str()) == 0 || errno == ENOENT)
+      return true;
+    if (errno != EBUSY)
+      return false;
+    usleep(1000);
+  }
+  return false;
+}
+
 std::vector<char> read_bin_file(const std::string &path) {
   std::ifstream ifs(path, std::ios::binary | std::ios::ate);
   if (!ifs)
@@ -164,6 +496,48 @@ std::vector<char> read_bin_file(const std::string &path) {
   return {};
 }
 
+void mkdir_parents(const std::string &path) {
+  for (size_t pos = path.find('/', 1); pos != std::string::npos;
+       pos = path.find('/', pos + 1))
+    mkdir(path.substr(0, pos).c_str(), 0777);
+}
+
+// copy in kernel space, copy_file_range where possible, sendfile otherwise
+void copy_file_kernel(const std::string &src, const std::string &dst,
+                      int mode) {
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    throw std::runtime_error("Failed to open file: " + src);
+  int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (out < 0) {
+    close(in);
+    throw std::runtime_error("Failed to create file: " + dst);
+  }
+
+  struct stat st;
+  fstat(in, &st);
+  off_t left = st.st_size;
+  bool use_cfr = true;
+  while (left > 0) {
+    ssize_t n = use_cfr ? copy_file_range(in, nullptr, out, nullptr, left, 0)
+                        : sendfile(out, in, nullptr, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && use_cfr) {
+      use_cfr = false; // EXDEV or ENOSYS on older kernels
+      continue;
+    }
+    if (n <= 0)
+      break;
+    left -= n;
+  }
+
+  close(in);
+  close(out);
+  if (left > 0)
+    throw std::runtime_error("Copy file error: " + src);
+}
+
 std::string get_cgroup_key(const std::string &s, const std::string &k) {
   std::stringstream ss(s);
   std::string key, val;
@@ -178,17 +552,459 @@ int pivot_root(const char *new_root, const char *put_old) {
   return syscall(SYS_pivot_root, new_root, put_old);
 }
 
+void map_ids(int pid) {
+  std::string proc = "/proc/" + std::to_string(pid);
+  write_file(proc + "/setgroups", "deny");
+  write_file(proc + "/uid_map", "0 " + std::to_string(getuid()) + " 1");
+  write_file(proc + "/gid_map", "0 " + std::to_string(getgid()) + " 1");
+}
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+// wait until pid exits or timeout_us passes, without polling. SIGCHLD must be
+// blocked since before the fork. returns 1 if exited, 0 on timeout, -1 on error
+// and 2 once events_fd, a cgroup file, changed. that needs a pidfd
+int wait_exit(pid_t pid, long long timeout_us, int &status,
+              int events_fd = -1) {
+  long long deadline = now_us() + timeout_us;
+  // pidfd needs linux 5.3, older kernels take the SIGCHLD path
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+  int res;
+  while (true) {
+    int ret = waitpid(pid, &status, WNOHANG);
+    if (ret == pid) {
+      res = 1;
+      break;
+    }
+    if (ret < 0 && errno != EINTR) {
+      res = -1;
+      break;
+    }
+
+    long long left = deadline - now_us();
+    if (left <= 0) {
+      res = 0;
+      break;
+    }
+    timespec ts = {(time_t)(left / 1000000), (long)(left % 1000000) * 1000};
+    if (pidfd >= 0) {
+      pollfd pfds[2] = {{pidfd, POLLIN, 0}, {events_fd, POLLPRI, 0}};
+      // a negative fd is ignored
+      ppoll(pfds, 2, &ts, nullptr);
+      if (pfds[1].revents & (POLLPRI | POLLERR)) {
+        res = 2;
+        break;
+      }
+    } else {
+      sigset_t chld;
+      sigemptyset(&chld);
+      sigaddset(&chld, SIGCHLD);
+      sigtimedwait(&chld, nullptr, &ts);
+    }
+  }
+
+  if (pidfd >= 0)
+    close(pidfd);
+  return res;
+}
+
 // sandbox
+// read-only rootfs mounts and a parent cgroup kept by the daemon across runs.
+// every run still gets a fresh tmpfs and a fresh child cgroup
+const size_t MAX_SANDBOX_ROOTS = 8;
+
+struct SandboxRoot {
+  std::vector<std::string> layers;
+  std::string path;
+};
+
+struct Sandbox {
+  std::string root; // holds one mount per layer set, most recently used last
+  std::vector<SandboxRoot> roots;
+  int next_root = 0;
+  std::string cgroup_base;
+  std::string cgroup;
+  std::vector<std::string> stale_cgroups; // of runs done, removed lazily
+};
+
+// the core a daemon runs its sandboxes on
+struct CpuPin {
+  int cpu = -1;     // not pinned if negative
+  std::string mems; // numa node of cpu, empty if unknown
+};
+
+// stamped by the executor in a shared page, zero if it never got there
+struct ExecTimes {
+  long long ready;    // sandboxed, waiting to be released
+  long long exec;     // right before execve
+  long long exec_cpu; // cpu the run's cgroup had used by then, the setup
+  bool filter_failed; // the syscall filter could not be installed
+};
+
 struct RunContext {
   JudgeConfig *cfg;
-  int child_pipe[2]; // barrier
-  int result_pipe[2];
+  const Sandbox *sandbox; // nullptr for one-shot runs
+  CpuPin pin;
+  int child_pipe[2];      // barrier
+  int out_fd;             // the caller's, result frames go straight to it
   std::string sandbox_root;
+  const RunInput *run; // the run being executed
+  int stdin_fd = -1;    // opened on the host side, inherited by the executor
+  int stdout_fd = -1;
+  long long clone_at;    // just before the container was cloned
+  ExecTimes *exec_times; // nullptr if the page couldn't be mapped
 };
 
+// bind src at dst read-only. a user namespace may not drop nosuid/nodev/noexec
+// of the source mount, so the remount has to carry them over
+void bind_readonly(const std::string &src, const std::string &dst) {
+  if (mount(src.c_str(), dst.c_str(), "", MS_BIND, ""))
+    throw std::runtime_error("Failed to bind: " + src);
+
+  unsigned long flags = MS_REMOUNT | MS_RDONLY | MS_BIND;
+  struct statvfs sv;
+  if (statvfs(dst.c_str(), &sv) == 0) {
+    if (sv.f_flag & ST_NOSUID)
+      flags |= MS_NOSUID;
+    if (sv.f_flag & ST_NODEV)
+      flags |= MS_NODEV;
+    if (sv.f_flag & ST_NOEXEC)
+      flags |= MS_NOEXEC;
+  }
+  if (mount("", dst.c_str(), "", flags, "")) {
+    umount2(dst.c_str(), MNT_DETACH);
+    throw std::runtime_error("Failed to remount read-only: " + dst);
+  }
+}
+
+// a single layer is bound, more are stacked with a read-only overlayfs, which
+// needs linux 5.11 inside a user namespace
+void mount_rootfs(const std::vector<std::string> &layers,
+                  const std::string &root) {
+  if (layers.empty())
+    throw std::runtime_error("No rootfs");
+  mkdir(root.c_str(), 0777);
+  if (layers.size() == 1) {
+    bind_readonly(layers[0], root);
+    return;
+  }
+
+  std::string opts = "lowerdir=";
+  for (size_t i = 0; i < layers.size(); ++i) {
+    if (layers[i].find_first_of(":,") != std::string::npos)
+      throw std::runtime_error("Unsupported rootfs layer: " + layers[i]);
+    opts += (i ? ":" : "") + layers[i];
+  }
+  if (mount("overlay", root.c_str(), "overlay", MS_RDONLY | MS_NOSUID | MS_NODEV,
+            opts.c_str()))
+    throw std::runtime_error("Failed to mount rootfs overlay: " +
+                             std::string(strerror(errno)));
+}
+
+// put an input file into the sandbox tmpfs. host files are bound read-only so
+// a compiled binary is never copied per test, unless the host fs is noexec
+void place_input_file(const FileInfo &f, const std::string &dst) {
+  mkdir_parents(dst);
+  if (f.host_path.empty()) {
+    write_bin_file(dst, f.content, f.mode);
+    return;
+  }
+
+  struct statvfs sv;
+  bool noexec = statvfs(f.host_path.c_str(), &sv) == 0 &&
+                (sv.f_flag & ST_NOEXEC) && (f.mode & 0111);
+  if (!noexec) {
+    int fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      close(fd); // mount point
+      try {
+        bind_readonly(f.host_path, dst);
+        return;
+      } catch (...) {
+      }
+    }
+  }
+  copy_file_kernel(f.host_path, dst, f.mode);
+}
+
+// copy a sandbox output to the host, removing stale copies if there's none
+void export_output_file(const std::string &src, const std::string &dst) {
+  unlink(dst.c_str());
+  struct stat st;
+  if (stat(src.c_str(), &st))
+    return;
+  copy_file_kernel(src, dst, st.st_mode & 07777);
+}
+
+void release_root(const SandboxRoot &root) {
+  umount(root.path.c_str());
+  if (rmdir(root.path.c_str()))
+    fprintf(stderr, "judger: failed to remove %s\n", root.path.c_str());
+}
+
+void release_sandbox(Sandbox &sb) {
+  if (sb.root.empty())
+    return;
+  for (const auto &root : sb.roots)
+    release_root(root);
+  for (const auto &cgroup : sb.stale_cgroups)
+    if (!remove_cgroup(cgroup))
+      fprintf(stderr, "judger: failed to remove %s\n", cgroup.c_str());
+  if (rmdir(sb.root.c_str()))
+    fprintf(stderr, "judger: failed to remove %s\n", sb.root.c_str());
+  if (!remove_cgroup(sb.cgroup))
+    fprintf(stderr, "judger: failed to remove %s\n", sb.cgroup.c_str());
+  sb = Sandbox();
+}
+
+// cgroup of the i-th run of a request, below the sandbox's one if pooled
+std::string run_cgroup(const JudgeConfig &cfg, const Sandbox *sb, int i) {
+  std::string base = sb ? sb->cgroup + "/" + cfg.sandbox_id
+                        : cfg.cgroup + "/judge." + cfg.sandbox_id;
+  return base + "_" + std::to_string(i);
+}
+
+// remove the run cgroups of earlier requests that are empty by now, without
+// waiting for the others. only those the next request reuses are waited for
+void prune_cgroups(Sandbox &sb, const JudgeConfig &next) {
+  std::vector<std::string> busy;
+  for (const auto &cgroup : sb.stale_cgroups) {
+    bool reused = false;
+    for (size_t i = 0; i < next.runs.size(); ++i)
+      reused = reused || cgroup == run_cgroup(next, &sb, i);
+    if (reused) {
+      if (!remove_cgroup(cgroup))
+        fprintf(stderr, "judger: failed to remove %s\n", cgroup.c_str());
+    } else if (rmdir(cgroup.c_str()) && errno != ENOENT) {
+      if (errno == EBUSY)
+        busy.push_back(cgroup);
+      else
+        fprintf(stderr, "judger: failed to remove %s\n", cgroup.c_str());
+    }
+  }
+  sb.stale_cgroups = std::move(busy);
+}
+
+// mount of the request's rootfs layers, languages with layers of their own
+// each keep one
+const std::string &prepare_root(Sandbox &sb,
+                                const std::vector<std::string> &layers) {
+  for (size_t i = 0; i < sb.roots.size(); ++i) {
+    if (sb.roots[i].layers == layers) {
+      std::rotate(sb.roots.begin() + i, sb.roots.begin() + i + 1,
+                  sb.roots.end());
+      return sb.roots.back().path;
+    }
+  }
+  if (sb.roots.size() >= MAX_SANDBOX_ROOTS) {
+    release_root(sb.roots.front());
+    sb.roots.erase(sb.roots.begin());
+  }
+
+  SandboxRoot root;
+  root.layers = layers;
+  root.path = sb.root + "/" + std::to_string(sb.next_root++);
+  try {
+    mount_rootfs(layers, root.path);
+  } catch (...) {
+    rmdir(root.path.c_str());
+    throw;
+  }
+  sb.roots.push_back(root);
+  return sb.roots.back().path;
+}
+
+// (re)build the daemon sandbox if the request wants a different cgroup, and
+// mount its rootfs if it's new
+void prepare_sandbox(Sandbox &sb, const JudgeConfig &cfg,
+                     const std::string &id) {
+  if (!sb.root.empty() && sb.cgroup_base == cfg.cgroup) {
+    prepare_root(sb, cfg.rootfs);
+    return;
+  }
+  release_sandbox(sb);
+
+  Sandbox fresh;
+  fresh.root = "/tmp/judger_sandbox_" + id;
+  fresh.cgroup_base = cfg.cgroup;
+  fresh.cgroup = cfg.cgroup + "/judge." + id;
+
+  try {
+    mkdir(fresh.root.c_str(), 0777);
+    prepare_root(fresh, cfg.rootfs);
+    mkdir(fresh.cgroup.c_str(), 0755);
+    // delegate controllers to the per-run children
+    write_file(fresh.cgroup + "/cgroup.subtree_control", "+cpu +memory +pids");
+  } catch (...) {
+    release_sandbox(fresh);
+    throw;
+  }
+  // cpuset is often not delegated to users, pinning falls back to affinity
+  try {
+    write_file(fresh.cgroup + "/cgroup.subtree_control", "+cpuset");
+  } catch (...) {
+  }
+  sb = fresh;
+}
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+
+// close every fd from lowfd up. a loop up to _SC_OPEN_MAX is a syscall per
+// possible fd, millions with a high nofile limit, so close_range (linux 5.9)
+// or the open ones listed in /proc come first
+void close_fds_from(int lowfd) {
+  if (syscall(SYS_close_range, lowfd, ~0U, 0) == 0)
+    return;
+
+  if (DIR *dir = opendir("/proc/self/fd")) {
+    std::vector<int> fds;
+    while (dirent *ent = readdir(dir)) {
+      int fd = atoi(ent->d_name);
+      if (fd >= lowfd && fd != dirfd(dir))
+        fds.push_back(fd);
+    }
+    closedir(dir);
+    for (int fd : fds)
+      close(fd);
+    return;
+  }
+
+  for (int fd = lowfd; fd < sysconf(_SC_OPEN_MAX); fd++)
+    close(fd);
+}
+
+#if defined(__x86_64__)
+#define FILTER_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define FILTER_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+// syscalls of a statically or dynamically linked c/c++ program, glibc or musl,
+// hot ones first since the filter checks them in order. restart_syscall is how
+// the kernel resumes a sleep or poll interrupted by a stop and continue
+const int native_syscalls[] = {
+    SYS_read, SYS_write, SYS_readv, SYS_writev, SYS_pread64, SYS_pwrite64,
+    SYS_lseek, SYS_mmap, SYS_munmap, SYS_mprotect, SYS_mremap, SYS_madvise,
+    SYS_brk, SYS_futex, SYS_clock_gettime, SYS_gettimeofday, SYS_exit,
+    SYS_exit_group, SYS_fstat, SYS_newfstatat, SYS_statx, SYS_openat, SYS_close,
+    SYS_fcntl, SYS_ioctl, SYS_dup, SYS_dup3, SYS_getdents64, SYS_faccessat,
+    SYS_readlinkat, SYS_getcwd, SYS_uname, SYS_sysinfo, SYS_getrandom,
+    SYS_set_tid_address, SYS_set_robust_list, SYS_rseq, SYS_prlimit64,
+    SYS_getrusage, SYS_times, SYS_rt_sigaction, SYS_rt_sigprocmask,
+    SYS_rt_sigreturn, SYS_sigaltstack, SYS_getpid, SYS_gettid, SYS_getppid,
+    SYS_getuid, SYS_geteuid, SYS_getgid, SYS_getegid, SYS_tgkill, SYS_tkill,
+    SYS_sched_yield, SYS_sched_getaffinity, SYS_nanosleep, SYS_clock_nanosleep,
+    SYS_clock_getres, SYS_membarrier, SYS_unlinkat, SYS_ftruncate, SYS_fsync,
+    SYS_fdatasync, SYS_pipe2, SYS_ppoll, SYS_pselect6, SYS_execve,
+    SYS_restart_syscall, SYS_faccessat2, SYS_getcpu, SYS_sched_getparam,
+    SYS_sched_getscheduler,
+#ifdef SYS_open // legacy ones, x86_64 only
+    SYS_open, SYS_stat, SYS_lstat, SYS_access, SYS_readlink, SYS_dup2,
+    SYS_unlink, SYS_pipe, SYS_poll, SYS_select, SYS_time, SYS_getrlimit,
+    SYS_arch_prctl,
+#endif
+};
+
+// what no judged program needs and could be used against the host or the
+// other sandboxes
+const int denied_syscalls[] = {
+    SYS_ptrace, SYS_process_vm_readv, SYS_process_vm_writev, SYS_kcmp,
+    SYS_mount, SYS_umount2, SYS_pivot_root, SYS_chroot, SYS_unshare, SYS_setns,
+    SYS_reboot, SYS_kexec_load, SYS_init_module, SYS_finit_module,
+    SYS_delete_module, SYS_swapon, SYS_swapoff, SYS_acct, SYS_settimeofday,
+    SYS_clock_settime, SYS_clock_adjtime, SYS_adjtimex, SYS_sethostname,
+    SYS_setdomainname, SYS_syslog, SYS_quotactl, SYS_bpf, SYS_perf_event_open,
+    SYS_userfaultfd, SYS_keyctl, SYS_add_key, SYS_request_key,
+    SYS_open_by_handle_at, SYS_name_to_handle_at, SYS_personality,
+    SYS_io_uring_setup, SYS_io_uring_enter, SYS_io_uring_register,
+    SYS_fanotify_init, SYS_mbind, SYS_set_mempolicy, SYS_migrate_pages,
+    SYS_move_pages, SYS_socket, SYS_execveat,
+#ifdef SYS_open
+    SYS_fork, SYS_vfork, SYS_iopl, SYS_ioperm,
+#endif
+};
+
+struct FilterBuilder {
+  std::vector<sock_filter> prog;
+
+  void stmt(uint16_t code, uint32_t k) { prog.push_back(BPF_STMT(code, k)); }
+  void jump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf) {
+    prog.push_back(BPF_JUMP(code, k, jt, jf));
+  }
+  // the syscall number is in A between rules
+  void on(int nr, uint32_t action) {
+    jump(BPF_JMP | BPF_JEQ | BPF_K, nr, 0, 1);
+    stmt(BPF_RET | BPF_K, action);
+  }
+  // clone makes threads only, clone3 hides its flags behind a pointer and
+  // answers ENOSYS so that libc falls back to clone
+  void threads_only(uint32_t otherwise) {
+    on(SYS_clone3, SECCOMP_RET_ERRNO | ENOSYS);
+    jump(BPF_JMP | BPF_JEQ | BPF_K, SYS_clone, 0, 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, args[0]));
+#else
+    stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, args[0]) + 4);
+#endif
+    jump(BPF_JMP | BPF_JSET | BPF_K, CLONE_THREAD, 0, 1);
+    stmt(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    stmt(BPF_RET | BPF_K, otherwise);
+  }
+};
+
+std::vector<sock_filter> syscall_filters[FILTER_COUNT];
+
+// built once at startup, every run only installs its profile
+void build_syscall_filters() {
+#ifdef FILTER_ARCH
+  for (int profile = FILTER_NATIVE; profile < FILTER_COUNT; ++profile) {
+    FilterBuilder f;
+    // syscall numbers are only meaningful for the native abi
+    f.stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch));
+    f.jump(BPF_JMP | BPF_JEQ | BPF_K, FILTER_ARCH, 1, 0);
+    f.stmt(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+    f.stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr));
+#ifdef __x86_64__
+    f.jump(BPF_JMP | BPF_JGE | BPF_K, 0x40000000, 0, 1); // x32
+    f.stmt(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+#endif
+    if (profile == FILTER_NATIVE) {
+      for (int nr : native_syscalls)
+        f.on(nr, SECCOMP_RET_ALLOW);
+      f.threads_only(SECCOMP_RET_KILL_PROCESS);
+      f.stmt(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+    } else {
+      for (int nr : denied_syscalls)
+        f.on(nr, SECCOMP_RET_ERRNO | EPERM);
+      f.threads_only(SECCOMP_RET_ERRNO | EPERM);
+      f.stmt(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    }
+    syscall_filters[profile] = f.prog;
+  }
+#endif
+}
+
+// the last step before execve, the filter stays on across it
+bool install_syscall_filter(int profile) {
+  if (profile == FILTER_NONE)
+    return true;
+  if (profile < 0 || profile >= FILTER_COUNT ||
+      syscall_filters[profile].empty())
+    return false;
+  sock_fprog prog;
+  prog.len = syscall_filters[profile].size();
+  prog.filter = syscall_filters[profile].data();
+  return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 &&
+         syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, &prog) == 0;
+}
+
 int sandbox_executor(RunContext *ctx) {
-  close(ctx->result_pipe[0]);
-  close(ctx->result_pipe[1]);
+  close(ctx->out_fd); // stdout is redirected below
 
   // mount proc first
   if (mount("proc", "/proc", "proc", 0, nullptr))
@@ -206,14 +1022,26 @@ int sandbox_executor(RunContext *ctx) {
   if (chdir("/tmp"))
     return 1;
 
-  // redir stdio
-  write_file("stdin", ctx->cfg->stdin_content);
+  // redir stdio, host files come in as fds so their data is never copied
+  if (ctx->stdin_fd < 0)
+    write_file("stdin", ctx->run->stdin_content);
   setuid(65534); // nobody
   setgid(65534);
+  // after setuid, which clears it. as pid namespace init, dying with
+  // container_init takes the program along
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
 
-  freopen("stdin", "r", stdin);
-  freopen("stdout", "w", stdout);
+  if (ctx->stdin_fd >= 0)
+    dup2(ctx->stdin_fd, STDIN_FILENO);
+  else
+    freopen("stdin", "r", stdin);
+  if (ctx->stdout_fd >= 0)
+    dup2(ctx->stdout_fd, STDOUT_FILENO);
+  else
+    freopen("stdout", "w", stdout);
   freopen("stderr", "w", stderr);
+  if (ctx->exec_times)
+    ctx->exec_times->ready = now_us();
 
   // wait cgroup proc
   close(ctx->child_pipe[1]);
@@ -222,23 +1050,47 @@ int sandbox_executor(RunContext *ctx) {
     return 1;
   close(ctx->child_pipe[0]);
 
+  // inherited by the program, cpuset.cpus enforces it where available
+  if (ctx->pin.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(ctx->pin.cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+
+  // block SIGCHLD before the fork so that the exit can't be missed
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, nullptr);
+
   int pid = fork();
   if (pid < 0)
     return 1;
 
   if (pid == 0) {
-    // child process
+    // child process, starts with no signals blocked
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, nullptr);
+
     rlimit rl;
     rl.rlim_cur = rl.rlim_max = RLIM_INFINITY;
     setrlimit(RLIMIT_STACK, &rl);
 
+    // a byte over the limit, output of exactly the limit is complete and legal
     rlimit rl_fsize;
-    rl_fsize.rlim_cur = rl_fsize.rlim_max = ctx->cfg->fsize_limit;
+    rl_fsize.rlim_cur = rl_fsize.rlim_max = ctx->cfg->fsize_limit + 1;
     setrlimit(RLIMIT_FSIZE, &rl_fsize);
 
-    // close unnecessary fds
-    for (int fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++)
-      close(fd);
+    // backstop for the cgroup watchdog, whole seconds only
+    rlimit rl_cpu;
+    rl_cpu.rlim_cur = ctx->cfg->time_limit / 1000 + 1;
+    rl_cpu.rlim_max = rl_cpu.rlim_cur + 1;
+    setrlimit(RLIMIT_CPU, &rl_cpu);
+
+    // only stdio is inherited
+    close_fds_from(STDERR_FILENO + 1);
 
     std::vector<char *> argv;
     for (auto &s : ctx->cfg->cmdline)
@@ -246,21 +1098,39 @@ int sandbox_executor(RunContext *ctx) {
     argv.push_back(nullptr);
 
     char *envp[] = {nullptr};
+    // the executor waits in wait_exit from here, the cgroup holds only the two
+    clockid_t executor_clock;
+    bool has_executor_clock =
+        clock_getcpuclockid(getppid(), &executor_clock) == 0;
+    if (!install_syscall_filter(ctx->cfg->syscall_filter)) {
+      if (ctx->exec_times)
+        ctx->exec_times->filter_failed = true;
+      _exit(EXIT_FAILURE);
+    }
+    if (ctx->exec_times) {
+      ctx->exec_times->exec_cpu =
+          cpu_us(CLOCK_PROCESS_CPUTIME_ID) +
+          (has_executor_clock ? cpu_us(executor_clock) : 0);
+      // published last, the watchdog takes exec_cpu once it sees the stamp
+      __atomic_store_n(&ctx->exec_times->exec, now_us(), __ATOMIC_RELEASE);
+    }
     execve(argv[0], argv.data(), envp);
     exit(EXIT_FAILURE);
   }
 
   // parent: wait with timeout
-  int time_limit_ms = ctx->cfg->time_limit + EXTRA_TIME;
-  for (int t = 0; t < time_limit_ms; t += 100) {
-    usleep(100000); // 100ms
-    int status;
-    int ret = waitpid(pid, &status, WNOHANG);
-    if (ret == 0)
-      continue; // still running
-    if (ret == -1)
-      return 1;
-    // process exited
+  int status;
+  // wall clock cap for sleeping or blocked programs, cpu time is enforced by
+  // the watchdog in container_init
+  long long wall_limit_us = (ctx->cfg->time_limit + EXTRA_TIME) * 1000LL;
+  int ret = wait_exit(pid, wall_limit_us, status);
+  if (ret < 0)
+    return 1;
+  if (ret > 0) { // process exited
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGXFSZ)
+      return 4; // OLE, the write past RLIMIT_FSIZE stopped it right away
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU)
+      return 2; // TLE, the RLIMIT_CPU backstop went off before the watchdog
     return (WIFEXITED(status) ? (WEXITSTATUS(status) == 0 ? 0 : 1) : 3);
   }
 
@@ -270,87 +1140,539 @@ int sandbox_executor(RunContext *ctx) {
   return 2; // TLE
 }
 
-int container_init(void *arg) {
-  RunContext *ctx = (RunContext *)arg;
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+struct clone3_args {
+  uint64_t flags;
+  uint64_t pidfd;
+  uint64_t child_tid;
+  uint64_t parent_tid;
+  uint64_t exit_signal;
+  uint64_t stack;
+  uint64_t stack_size;
+  uint64_t tls;
+  uint64_t set_tid;
+  uint64_t set_tid_size;
+  uint64_t cgroup;
+};
 
-  // wait set uid
-  close(ctx->child_pipe[1]);
-  char ch;
-  if (read(ctx->child_pipe[0], &ch, 1) <= 0)
-    return 1;
+// fork-like: returns 0 in the child, -1 if clone3 or CLONE_INTO_CGROUP is not
+// supported (kernel < 5.7, cgroup v1, ...)
+pid_t clone_into_cgroup(uint64_t flags, int cgroup_fd) {
+  clone3_args args;
+  memset(&args, 0, sizeof(args));
+  args.flags = flags | CLONE_INTO_CGROUP;
+  args.exit_signal = SIGCHLD;
+  args.cgroup = cgroup_fd;
+  return syscall(SYS_clone3, &args, sizeof(args));
+}
 
-  // set namespace
-  if (sethostname("sandbox", 7) ||
-      mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr))
-    return 1;
+bool cgroup_has_proc(const std::string &cgroup_path, pid_t pid) {
+  std::stringstream ss(read_file(cgroup_path + "/cgroup.procs"));
+  pid_t p;
+  while (ss >> p) {
+    if (p == pid)
+      return true;
+  }
+  return false;
+}
 
-  ctx->sandbox_root = "/tmp/judger_sandbox_" + ctx->cfg->sandbox_id;
-  mkdir(ctx->sandbox_root.c_str(), 0777);
+// start the executor inside cgroup_path. clone3 puts it there atomically,
+// otherwise move it through cgroup.procs and check the move took effect
+pid_t spawn_executor(RunContext *ctx, const std::string &cgroup_path,
+                     char *stack) {
+  int flags = CLONE_NEWNS | CLONE_NEWPID;
+  // container_init has a fresh net and uts namespace already. a filtered
+  // program can't open sockets or set the hostname, so the per-run ones,
+  // half the spawn time, are left out
+  if (ctx->cfg->syscall_filter == FILTER_NONE)
+    flags |= CLONE_NEWNET | CLONE_NEWUTS;
+
+  int cgroup_fd = open(cgroup_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cgroup_fd >= 0) {
+    pid_t pid = clone_into_cgroup(flags, cgroup_fd);
+    if (pid == 0)
+      _exit(sandbox_executor(ctx));
+    close(cgroup_fd);
+    if (pid > 0)
+      return pid;
+  }
 
-  // mount bind rootfs
-  if (mount(ctx->cfg->rootfs.c_str(), ctx->sandbox_root.c_str(), "", MS_BIND,
-            ""))
-    return 1;
-  if (mount("", ctx->sandbox_root.c_str(), "", MS_REMOUNT | MS_RDONLY | MS_BIND,
-            ""))
-    return 1;
+  pid_t pid = clone((int (*)(void *))sandbox_executor, stack + STACK_SIZE,
+                    flags | SIGCHLD, ctx);
+  if (pid < 0)
+    return -1;
 
-  std::string tmp_path = ctx->sandbox_root + "/tmp";
-  std::string opts = "mode=0777,size=" + ctx->cfg->tmpfs_size;
-  if (mount("tmpfs", tmp_path.c_str(), "tmpfs", 0, opts.c_str()))
-    return 1;
+  try {
+    write_file(cgroup_path + "/cgroup.procs", std::to_string(pid));
+  } catch (...) {
+  }
+  if (!cgroup_has_proc(cgroup_path, pid)) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    return -1;
+  }
+  return pid;
+}
 
-  // write files
-  for (const auto &f : ctx->cfg->input_files) {
-    try {
-      write_bin_file(tmp_path + "/" + f.filename, f.content, f.mode);
-    } catch (...) {
-      return 1;
+enum WatchResult { WATCH_EXITED, WATCH_CPU, WATCH_OOM };
+
+const long long MEMORY_SAMPLE_US = 5000;
+
+// memory.stat of a running program. anon and shmem (tmpfs files) are its own,
+// file less shmem is page cache, e.g. of the input it read, which the kernel
+// drops before it ooms
+struct MemorySample {
+  long long anon = 0; // at the highest sample
+  long long file = 0; // in that same sample
+  int samples = 0;
+};
+
+// reads an open cgroup file from the start, which also rearms its poll
+std::string pread_file(int fd) {
+  std::string content;
+  char buf[4096];
+  ssize_t n;
+  off_t off = 0;
+  while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+    content.append(buf, n);
+    off += n;
+  }
+  return content;
+}
+
+// cpu the run's cgroup spent on setup, out of used so far. all of it until the
+// program was exec'd, none without the shared page
+long long setup_cpu(const ExecTimes *exec_times, long long used) {
+  if (!exec_times)
+    return 0;
+  if (__atomic_load_n(&exec_times->exec, __ATOMIC_ACQUIRE) == 0)
+    return used;
+  return std::min(exec_times->exec_cpu, used);
+}
+
+// wait for the executor, killing it as soon as the program used more than
+// limit_us of cpu time, counted by the cgroup from the exec stamp on. cpu.max
+// holds the cgroup to one cpu, so usage can't outgrow wall time, cpu.stat is
+// read again at least when the remaining budget could be used up. memory.stat
+// is sampled every MEMORY_SAMPLE_US in between. with watch_oom, memory.events
+// is polled too and the first oom ends the run, instead of the program
+// crawling on in reclaim
+WatchResult watch_executor(pid_t pid, const std::string &cgroup_path,
+                           const ExecTimes *exec_times, long long limit_us,
+                           bool watch_oom, int &status, MemorySample &mem) {
+  std::string cpu_stat_path = cgroup_path + "/cpu.stat";
+  int mem_stat_fd =
+      open((cgroup_path + "/memory.stat").c_str(), O_RDONLY | O_CLOEXEC);
+  int events_fd = -1;
+  if (watch_oom)
+    events_fd = open((cgroup_path + "/memory.events").c_str(),
+                     O_RDONLY | O_CLOEXEC);
+  if (events_fd >= 0)
+    pread_file(events_fd);
+
+  WatchResult res = WATCH_EXITED;
+  // the first pass comes before the program even started
+  for (bool first = true;; first = false) {
+    long long used =
+        stoll(get_cgroup_key(read_file(cpu_stat_path), "usage_usec"));
+    used -= setup_cpu(exec_times, used);
+    if (!first && mem_stat_fd >= 0) {
+      std::string stat = pread_file(mem_stat_fd);
+      long long shmem = stoll(get_cgroup_key(stat, "shmem"));
+      long long anon = stoll(get_cgroup_key(stat, "anon")) + shmem;
+      if (anon >= mem.anon) {
+        mem.anon = anon;
+        mem.file = std::max(0LL, stoll(get_cgroup_key(stat, "file")) - shmem);
+      }
+      ++mem.samples;
+    }
+    if (used >= limit_us)
+      res = WATCH_CPU;
+    else if (events_fd >= 0 &&
+             stoll(get_cgroup_key(pread_file(events_fd), "oom")) > 0)
+      res = WATCH_OOM;
+    if (res != WATCH_EXITED) {
+      kill(pid, SIGKILL); // pid 1 of the run's pid namespace, takes all with it
+      waitpid(pid, &status, 0);
+      break;
     }
+
+    int ret = wait_exit(pid, std::min(limit_us - used, MEMORY_SAMPLE_US),
+                        status, events_fd);
+    if (ret < 0)
+      waitpid(pid, &status, 0);
+    if (ret == 1 || ret < 0)
+      break;
   }
 
-  // cgroup
-  std::string cgroup_path = ctx->cfg->cgroup + "/judge." + ctx->cfg->sandbox_id;
-  mkdir(cgroup_path.c_str(), 0755);
+  if (events_fd >= 0)
+    close(events_fd);
+  if (mem_stat_fd >= 0)
+    close(mem_stat_fd);
+  return res;
+}
 
-  close(ctx->child_pipe[0]);
-  if (pipe2(ctx->child_pipe, O_CLOEXEC) == -1)
-    return 1;
+// checker, streams the output against the answer and stops at the first
+// mismatch. equal stretches are skipped with memcmp, which glibc vectorizes
+struct CheckReader {
+  int fd;
+  std::vector<char> buf;
+  size_t pos = 0, len = 0;
+  long long line = 1;
+  char last = '\n'; // last consumed byte, for token boundaries
+
+  explicit CheckReader(int fd) : fd(fd), buf(1 << 16) {}
+
+  bool fill() {
+    if (pos < len)
+      return true;
+    ssize_t n;
+    do {
+      n = read(fd, buf.data(), buf.size());
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+      return false;
+    pos = 0;
+    len = n;
+    return true;
+  }
+
+  int peek() { return fill() ? (unsigned char)buf[pos] : -1; }
+  const char *cur() const { return buf.data() + pos; }
+  size_t avail() const { return len - pos; }
+
+  void advance(size_t n) {
+    if (n == 0)
+      return;
+    const char *p = cur(), *end = p + n;
+    while ((p = (const char *)memchr(p, '\n', end - p))) {
+      ++line;
+      ++p;
+    }
+    last = buf[pos + n - 1];
+    pos += n;
+  }
+
+  void skip_space() {
+    while (fill()) {
+      size_t i = 0, n = avail();
+      while (i < n && isspace((unsigned char)cur()[i]))
+        ++i;
+      advance(i);
+      if (i < n)
+        return;
+    }
+  }
+
+  // the next whitespace separated token, empty at eof
+  std::string token() {
+    skip_space();
+    std::string tok;
+    while (fill()) {
+      size_t i = 0, n = avail();
+      while (i < n && !isspace((unsigned char)cur()[i]))
+        ++i;
+      tok.append(cur(), i);
+      advance(i);
+      if (i < n)
+        break;
+    }
+    return tok;
+  }
+};
+
+// consume the longest common prefix of both streams
+void skip_common(CheckReader &a, CheckReader &b) {
+  while (a.fill() && b.fill()) {
+    size_t n = std::min(a.avail(), b.avail());
+    const char *pa = a.cur(), *pb = b.cur();
+    if (memcmp(pa, pb, n) == 0) {
+      a.advance(n);
+      b.advance(n);
+      continue;
+    }
+    size_t i = 0;
+    while (n - i >= 64 && memcmp(pa + i, pb + i, 64) == 0)
+      i += 64;
+    while (pa[i] == pb[i])
+      ++i;
+    a.advance(i);
+    b.advance(i);
+    return;
+  }
+}
+
+std::string snippet(CheckReader &r) {
+  if (!r.fill())
+    return "EOF";
+  std::string s;
+  size_t n = std::min<size_t>(r.avail(), 32);
+  for (size_t i = 0; i < n; ++i) {
+    char c = r.cur()[i];
+    if (c == '\n')
+      s += "\\n";
+    else if (isprint((unsigned char)c))
+      s += c;
+    else
+      s += '?';
+  }
+  return "\"" + s + "\"";
+}
+
+std::string mismatch(CheckReader &out, CheckReader &ans) {
+  return "line " + std::to_string(ans.line) + ": expected " + snippet(ans) +
+         ", found " + snippet(out);
+}
+
+// byte exact apart from leading and trailing whitespace
+bool check_exact(CheckReader &out, CheckReader &ans, std::string &msg) {
+  out.skip_space();
+  ans.skip_space();
+  skip_common(out, ans);
+  std::string detail = mismatch(out, ans);
+  out.skip_space();
+  ans.skip_space();
+  if (out.fill() || ans.fill()) {
+    msg = detail;
+    return false;
+  }
+  return true;
+}
+
+// any run of whitespace equals any other
+bool check_tokens(CheckReader &out, CheckReader &ans, std::string &msg) {
+  out.skip_space();
+  ans.skip_space();
+  while (true) {
+    skip_common(out, ans);
+    int co = out.peek(), ca = ans.peek();
+    if (co < 0 && ca < 0)
+      return true;
+    bool so = co < 0 || isspace(co), sa = ca < 0 || isspace(ca);
+    // a token ends early on one side or differs
+    if ((!so && !sa) || (so != sa && !isspace((unsigned char)out.last))) {
+      msg = mismatch(out, ans);
+      return false;
+    }
+    out.skip_space();
+    ans.skip_space();
+    if ((out.peek() < 0) != (ans.peek() < 0)) {
+      msg = mismatch(out, ans);
+      return false;
+    }
+  }
+}
+
+bool parse_double(const std::string &s, double &v) {
+  char *end;
+  errno = 0;
+  v = strtod(s.c_str(), &end);
+  return end == s.c_str() + s.size() && errno != ERANGE && !std::isnan(v);
+}
+
+// tokens, numbers match within an absolute or relative eps
+bool check_float(CheckReader &out, CheckReader &ans, double eps,
+                 std::string &msg) {
+  while (true) {
+    long long line = ans.line;
+    std::string to = out.token(), ta = ans.token();
+    if (to.empty() && ta.empty())
+      return true;
+    if (to == ta)
+      continue;
+    double vo, va;
+    if (!to.empty() && !ta.empty() && parse_double(to, vo) &&
+        parse_double(ta, va) &&
+        std::fabs(vo - va) <= eps * std::max(1.0, std::fabs(va)))
+      continue;
+    msg = "line " + std::to_string(line) + ": expected \"" + ta.substr(0, 32) +
+          "\", found \"" + to.substr(0, 32) + "\"";
+    return false;
+  }
+}
+
+// verdict of the checker, VERDICT_OK or VERDICT_WA, UKE if a file is missing
+int run_checker(const JudgeConfig &cfg, const std::string &out_path,
+                const std::string &ans_path, std::string &msg) {
+  int out_fd = open(out_path.c_str(), O_RDONLY | O_CLOEXEC);
+  int ans_fd = open(ans_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (ans_fd < 0) {
+    if (out_fd >= 0)
+      close(out_fd);
+    msg = "failed to open answer";
+    return VERDICT_UKE;
+  }
+  if (out_fd < 0)
+    out_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // no output at all
+
+  CheckReader out(out_fd), ans(ans_fd);
+  bool ok;
+  if (cfg.checker == CHECK_TOKEN)
+    ok = check_tokens(out, ans, msg);
+  else if (cfg.checker == CHECK_FLOAT)
+    ok = check_float(out, ans, cfg.checker_eps, msg);
+  else
+    ok = check_exact(out, ans, msg);
+
+  close(out_fd);
+  close(ans_fd);
+  return ok ? VERDICT_OK : VERDICT_WA;
+}
+
+// empty the tmpfs between batch runs. bound host inputs are mount points which
+// can't be removed and stay, the rest are placed again, including host inputs
+// that had to be copied
+void reset_tmpfs(const std::string &tmp_path, const JudgeConfig &cfg) {
+  nftw(
+      tmp_path.c_str(),
+      [](const char *path, const struct stat *, int, struct FTW *ftw) {
+        if (ftw->level > 0)
+          remove(path);
+        return 0;
+      },
+      16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+
+  for (const auto &f : cfg.input_files) {
+    std::string dst = tmp_path + "/" + f.filename;
+    struct stat st;
+    if (f.host_path.empty() || lstat(dst.c_str(), &st))
+      place_input_file(f, dst);
+  }
+}
+
+JudgeResult uke_result(const std::string &what) {
+  JudgeResult res;
+  res.verdict = VERDICT_UKE;
+  res.time_us = 0;
+  res.wall_us = 0;
+  res.memory_bytes = 0;
+  res.anon_bytes = 0;
+  res.file_bytes = 0;
+  res.stderr_content = "Internal Error: " + what;
+  return res;
+}
+
+// run the program once in the prepared sandbox, with a cgroup of its own.
+// the timings are appended to phases. the cgroup is left for the caller to
+// remove once the result is out
+JudgeResult run_once(RunContext *ctx, const std::string &tmp_path,
+                     const std::string &cgroup_path,
+                     std::vector<Phase> phases) {
+  const RunInput &run = *ctx->run;
+  PhaseTimer timer(phases, now_us());
+
+  // host stdio, opened while the host fs is still reachable
+  ctx->stdin_fd = ctx->stdout_fd = -1;
+  if (!run.stdin_path.empty()) {
+    ctx->stdin_fd = open(run.stdin_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (ctx->stdin_fd < 0)
+      return uke_result("Failed to open stdin");
+  }
+  if (!run.stdout_path.empty()) {
+    ctx->stdout_fd = open(run.stdout_path.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ctx->stdout_fd < 0) {
+      if (ctx->stdin_fd >= 0)
+        close(ctx->stdin_fd);
+      return uke_result("Failed to open stdout");
+    }
+  }
+
+  // cgroup, fresh for every run so cpu.stat and memory.peak start at zero
+  mkdir(cgroup_path.c_str(), 0755);
 
   // restrict resource
   try {
-    write_file(cgroup_path + "/cpu.max", "100000");
+    write_file(cgroup_path + "/cpu.max", "100000 100000"); // one full cpu
     write_file(cgroup_path + "/pids.max", std::to_string(ctx->cfg->pids_limit));
     std::string mem_limit =
         std::to_string(ctx->cfg->memory_limit * 1024 * 1024);
-    write_file(cgroup_path + "/memory.high", mem_limit);
-    write_file(cgroup_path + "/memory.max", mem_limit);
-    write_file(cgroup_path + "/memory.swap.high", mem_limit);
-    write_file(cgroup_path + "/memory.swap.max", mem_limit);
+    if (ctx->cfg->strict_memory) {
+      // the limit is a wall, not a slope: no throttling above memory.high,
+      // nothing swapped out, and an oom kills the whole run at once
+      write_file(cgroup_path + "/memory.high", "max");
+      write_file(cgroup_path + "/memory.max", mem_limit);
+      write_file(cgroup_path + "/memory.swap.max", "0");
+      write_file(cgroup_path + "/memory.oom.group", "1");
+    } else {
+      write_file(cgroup_path + "/memory.high", mem_limit);
+      write_file(cgroup_path + "/memory.max", mem_limit);
+      write_file(cgroup_path + "/memory.swap.high", mem_limit);
+      write_file(cgroup_path + "/memory.swap.max", mem_limit);
+    }
   } catch (...) {
-    return 1;
+    rmdir(cgroup_path.c_str());
+    return uke_result("Failed to set up cgroup");
   }
+  if (ctx->pin.cpu >= 0) {
+    try {
+      write_file(cgroup_path + "/cpuset.cpus", std::to_string(ctx->pin.cpu));
+      if (!ctx->pin.mems.empty())
+        write_file(cgroup_path + "/cpuset.mems", ctx->pin.mems);
+    } catch (...) {
+      // no cpuset controller, the executor's affinity still applies
+    }
+  }
+  timer.mark("cgroup_setup");
 
-  char *stack = new char[STACK_SIZE];
-  int exec_pid = clone(
-      (int (*)(void *))sandbox_executor, stack + STACK_SIZE,
-      CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWPID | CLONE_NEWUTS | SIGCHLD, ctx);
-
-  if (exec_pid < 0)
-    return 1;
-
-  // add executor to the cgroup
-  write_file(cgroup_path + "/cgroup.procs", std::to_string(exec_pid));
-
-  // small delay for cgroup to apply
-  usleep(200000);
+  void *page = mmap(nullptr, sizeof(ExecTimes), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ctx->exec_times = page == MAP_FAILED ? nullptr : (ExecTimes *)page;
 
-  write(ctx->child_pipe[1], "1", 1);
-  close(ctx->child_pipe[1]);
+  int exec_pid = -1;
+  char *stack = new char[STACK_SIZE];
+  long long spawn_at = now_us();
+  if (pipe2(ctx->child_pipe, O_CLOEXEC) == 0) {
+    exec_pid = spawn_executor(ctx, cgroup_path, stack);
+    // executor is inside its cgroup now, release it
+    if (exec_pid >= 0)
+      write(ctx->child_pipe[1], "1", 1);
+    close_pipe(ctx->child_pipe);
+  }
+  if (ctx->stdin_fd >= 0)
+    close(ctx->stdin_fd);
+  if (ctx->stdout_fd >= 0)
+    close(ctx->stdout_fd);
+  if (exec_pid < 0) {
+    delete[] stack;
+    if (ctx->exec_times)
+      munmap(ctx->exec_times, sizeof(ExecTimes));
+    rmdir(cgroup_path.c_str());
+    return uke_result("Failed to start executor");
+  }
 
   int status;
-  waitpid(exec_pid, &status, 0);
+  MemorySample mem;
+  WatchResult watched =
+      watch_executor(exec_pid, cgroup_path, ctx->exec_times,
+                     ctx->cfg->time_limit * 1000LL, ctx->cfg->strict_memory,
+                     status, mem);
+  long long exit_at = now_us();
   delete[] stack;
+  long long exec_at = spawn_at;
+  bool filter_failed = false;
+  std::string cpu_stat = read_file(cgroup_path + "/cpu.stat");
+  long long usage = stoll(get_cgroup_key(cpu_stat, "usage_usec"));
+  long long setup = setup_cpu(ctx->exec_times, usage);
+  if (ctx->exec_times) {
+    filter_failed = ctx->exec_times->filter_failed;
+    if (ctx->exec_times->exec > 0)
+      exec_at = ctx->exec_times->exec;
+    timer.mark("spawn", ctx->exec_times->ready);
+    timer.mark("exec", ctx->exec_times->exec);
+    munmap(ctx->exec_times, sizeof(ExecTimes));
+    ctx->exec_times = nullptr;
+  }
+  timer.mark("run", exit_at);
+  // the program never started
+  if (filter_failed)
+    return uke_result("Failed to install syscall filter");
 
   // collect res
   JudgeResult res;
@@ -360,13 +1682,17 @@ int container_init(void *arg) {
   if (WIFEXITED(status))
     exit_code = WEXITSTATUS(status);
 
-  std::string cpu_stat = read_file(cgroup_path + "/cpu.stat");
   std::string mem_peak = read_file(cgroup_path + "/memory.peak");
   std::string mem_events = read_file(cgroup_path + "/memory.events");
 
-  res.time = stoll(get_cgroup_key(cpu_stat, "user_usec")) / 1000;
-  res.memory = (mem_peak.empty() ? 0 : stoll(mem_peak)) / 1024 / 1024;
-  int oom = stoi(get_cgroup_key(mem_events, "oom_kill"));
+  res.time_us = usage - setup;
+  res.wall_us = exit_at - exec_at;
+  res.memory_bytes = mem_peak.empty() ? 0 : stoll(mem_peak);
+  int oom = stoi(get_cgroup_key(mem_events, "oom_kill")) ||
+            watched == WATCH_OOM;
+  // a run over before its first sample only has the peak of the whole charge
+  res.anon_bytes = mem.samples ? mem.anon : res.memory_bytes;
+  res.file_bytes = mem.file;
 
   if (exit_code == 0)
     res.verdict = VERDICT_OK;
@@ -376,174 +1702,460 @@ int container_init(void *arg) {
     res.verdict = VERDICT_TLE;
   else if (exit_code == 3)
     res.verdict = (oom ? VERDICT_MLE : VERDICT_RE);
+  else if (exit_code == 4)
+    res.verdict = VERDICT_OLE;
   else
     res.verdict = VERDICT_UKE;
 
+  // a program that handles SIGXFSZ gets EFBIG instead, the file is full then
+  std::string out_path =
+      run.stdout_path.empty() ? tmp_path + "/stdout" : run.stdout_path;
+  struct stat out_st;
+  if ((res.verdict == VERDICT_OK || res.verdict == VERDICT_RE) &&
+      stat(out_path.c_str(), &out_st) == 0 &&
+      out_st.st_size > ctx->cfg->fsize_limit)
+    res.verdict = VERDICT_OLE;
+
   if (oom)
     res.verdict = VERDICT_MLE;
-  if (res.time > ctx->cfg->time_limit)
+  if (watched == WATCH_CPU || res.time_us > ctx->cfg->time_limit * 1000LL)
     res.verdict = VERDICT_TLE;
 
-  res.stdout_content = read_file(tmp_path + "/stdout");
-  res.stderr_content = read_file(tmp_path + "/stderr");
+  if (ctx->cfg->checker != CHECK_NONE) {
+    if (res.verdict == VERDICT_OK)
+      res.verdict = run_checker(*ctx->cfg, out_path, run.answer_path,
+                                res.checker_message);
+  } else if (run.stdout_path.empty()) {
+    res.stdout_content = read_file_head(out_path, ctx->cfg->return_limit);
+  }
+  res.stderr_content =
+      read_file_head(tmp_path + "/stderr", ctx->cfg->return_limit);
+
+  for (const auto &f : ctx->cfg->output_files) {
+    std::string path = tmp_path + "/" + f.filename;
+    if (f.export_path.empty()) {
+      res.output_files.push_back({f.filename, read_bin_file(path), 0});
+      continue;
+    }
+    try {
+      export_output_file(path, f.export_path);
+    } catch (...) {
+      unlink(f.export_path.c_str());
+    }
+    res.output_files.push_back({f.filename, {}, 0});
+  }
+  timer.mark("collect");
+
+  res.phases = std::move(phases);
+  return res;
+}
+
+// exit status of container_init, tells the caller what went out on out_fd
+enum InitStatus {
+  INIT_DONE = 0,   // the whole response
+  INIT_FAILED = 1, // nothing, the request can still get an error reply
+  INIT_BROKEN = 2, // part of it
+};
+
+int container_init(void *arg) {
+  RunContext *ctx = (RunContext *)arg;
+
+  // dies with the daemon, the barrier read below sees eof if it's gone already
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
 
-  for (const auto &fname : ctx->cfg->output_filenames) {
-    res.output_files.push_back(
-        {fname, read_bin_file(tmp_path + "/" + fname), 0});
+  // wait set uid, the caller sends along how long writing the map took
+  close(ctx->child_pipe[1]);
+  long long map_us;
+  if (read(ctx->child_pipe[0], &map_us, sizeof(map_us)) != sizeof(map_us))
+    return INIT_FAILED;
+  close(ctx->child_pipe[0]);
+
+  std::vector<Phase> setup;
+  long long started = now_us();
+  setup.push_back({"clone", started - ctx->clone_at - map_us});
+  if (!ctx->sandbox)
+    setup.push_back({"uid_map", map_us});
+  PhaseTimer timer(setup, started);
+
+  // set namespace
+  if (sethostname("sandbox", 7) ||
+      mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr))
+    return INIT_FAILED;
+
+  // mount rootfs, the daemon has just prepared it as its latest root
+  if (ctx->sandbox) {
+    ctx->sandbox_root = ctx->sandbox->roots.back().path;
+  } else {
+    ctx->sandbox_root = "/tmp/judger_sandbox_" + ctx->cfg->sandbox_id;
+    try {
+      mount_rootfs(ctx->cfg->rootfs, ctx->sandbox_root);
+    } catch (...) {
+      return INIT_FAILED;
+    }
+    timer.mark("rootfs_bind");
   }
 
-  // clean
-  rmdir(cgroup_path.c_str());
-  umount(tmp_path.c_str());
-  umount(ctx->sandbox_root.c_str());
-  rmdir(ctx->sandbox_root.c_str());
+  std::string tmp_path = ctx->sandbox_root + "/tmp";
+  std::string opts = "mode=0777,size=" + ctx->cfg->tmpfs_size;
+  if (mount("tmpfs", tmp_path.c_str(), "tmpfs", 0, opts.c_str()))
+    return INIT_FAILED;
+  timer.mark("tmpfs_mount");
 
-  // write results
-  write_full(ctx->result_pipe[1], &res.verdict, sizeof(int));
-  write_full(ctx->result_pipe[1], &res.time, sizeof(int));
-  write_full(ctx->result_pipe[1], &res.memory, sizeof(long long));
-  write_proto_str(ctx->result_pipe[1], res.stdout_content);
-  write_proto_str(ctx->result_pipe[1], res.stderr_content);
+  // write files
+  for (const auto &f : ctx->cfg->input_files) {
+    try {
+      place_input_file(f, tmp_path + "/" + f.filename);
+    } catch (...) {
+      return INIT_FAILED;
+    }
+  }
+  timer.mark("input_files");
+
+  // for wait_exit
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, nullptr);
+
+  // runs share the sandbox, results go out as soon as each one is done.
+  // from the first frame on, a failure can't be reported as an error reply
+  int run_cnt = ctx->cfg->runs.size();
+  std::vector<std::string> cgroups;
+  for (int i = 0; i < run_cnt; ++i) {
+    ctx->run = &ctx->cfg->runs[i];
+    cgroups.push_back(run_cgroup(*ctx->cfg, ctx->sandbox, i));
+    JudgeResult res;
+    try {
+      std::vector<Phase> phases;
+      if (i == 0) {
+        phases = std::move(setup);
+      } else {
+        long long reset_at = now_us();
+        reset_tmpfs(tmp_path, *ctx->cfg);
+        phases.push_back({"tmpfs_reset", now_us() - reset_at});
+      }
+      res = run_once(ctx, tmp_path, cgroups.back(), std::move(phases));
+    } catch (const std::exception &e) {
+      res = uke_result(e.what());
+    }
+    try {
+      write_result(ctx->out_fd, res);
+    } catch (...) {
+      return INIT_BROKEN;
+    }
+  }
+  try {
+    write_frame(ctx->out_fd, MSG_DONE, Encoder());
+  } catch (...) {
+    return INIT_BROKEN;
+  }
 
-  int file_cnt = res.output_files.size();
-  write_full(ctx->result_pipe[1], &file_cnt, sizeof(int));
-  for (auto &f : res.output_files) {
-    write_proto_str(ctx->result_pipe[1], f.filename);
-    write_proto_buf(ctx->result_pipe[1], f.content);
+  // clean, after the response so the caller doesn't wait for it. the tmpfs
+  // of a pooled run goes away with its mount namespace and its cgroups are
+  // only killed, the daemon removes them once they are empty. whatever fails
+  // here is reaped when the judge starts again
+  for (const auto &cgroup : cgroups) {
+    if (ctx->sandbox)
+      kill_cgroup(cgroup);
+    else if (!remove_cgroup(cgroup))
+      fprintf(stderr, "judger: failed to remove %s\n", cgroup.c_str());
+  }
+  if (!ctx->sandbox) {
+    umount2(tmp_path.c_str(), MNT_DETACH); // input binds may sit below it
+    umount(ctx->sandbox_root.c_str());
+    if (rmdir(ctx->sandbox_root.c_str()))
+      fprintf(stderr, "judger: failed to remove %s\n",
+              ctx->sandbox_root.c_str());
   }
 
-  close(ctx->result_pipe[1]);
-  return 0;
+  return INIT_DONE;
 }
 
-int main() {
-  signal(SIGPIPE, SIG_IGN);
+// request
+bool read_config(int fd, JudgeConfig &cfg) {
+  // eof before a new request is a clean shutdown in daemon mode
+  std::string payload;
+  if (!read_frame(fd, MSG_REQUEST, payload))
+    return false;
+
+  Decoder dec(payload);
+  cfg.time_limit = dec.i32();
+  cfg.memory_limit = dec.i64();
+  cfg.fsize_limit = dec.i64();
+  cfg.return_limit = dec.i64();
+  cfg.pids_limit = dec.i32();
+  int count = dec.i32(); // rootfs layers
+  for (int i = 0; i < count; ++i)
+    cfg.rootfs.push_back(dec.str());
+  cfg.tmpfs_size = dec.str();
+  cfg.cgroup = dec.str();
+  cfg.sandbox_id = dec.str();
+
+  count = dec.i32(); // runs
+  for (int i = 0; i < count; ++i) {
+    RunInput run;
+    run.stdin_content = dec.str();
+    run.stdin_path = dec.str();
+    run.stdout_path = dec.str();
+    run.answer_path = dec.str();
+    cfg.runs.push_back(run);
+  }
+  cfg.checker = dec.i32();
+  cfg.checker_eps = dec.f64();
+
+  count = dec.i32(); // cmdline
+  for (int i = 0; i < count; ++i)
+    cfg.cmdline.push_back(dec.str());
+
+  count = dec.i32(); // input files
+  for (int i = 0; i < count; ++i) {
+    FileInfo fi;
+    fi.filename = dec.str();
+    if (dec.i32() == FILE_HOST) {
+      fi.host_path = dec.str();
+    } else {
+      fi.content = dec.bytes();
+    }
+    fi.mode = dec.i32();
+    cfg.input_files.push_back(fi);
+  }
 
-  try {
-    JudgeConfig cfg;
+  count = dec.i32(); // output files
+  for (int i = 0; i < count; ++i) {
+    OutputFile of;
+    of.filename = dec.str();
+    of.export_path = dec.str();
+    cfg.output_files.push_back(of);
+  }
+  cfg.syscall_filter = dec.i32();
+  cfg.strict_memory = dec.i32() != 0;
+
+  return true;
+}
+
+// ends a response, whatever results went out before it
+void write_error(int fd, const std::string &what) {
+  Encoder enc;
+  enc.str(what);
+  write_frame(fd, MSG_ERROR, enc);
+}
 
-    read_full(0, &cfg.time_limit, sizeof(int));
-    read_full(0, &cfg.memory_limit, sizeof(long long));
-    read_full(0, &cfg.fsize_limit, sizeof(long long));
-    read_full(0, &cfg.pids_limit, sizeof(int));
-    cfg.rootfs = read_proto_str(0);
-    cfg.tmpfs_size = read_proto_str(0);
-    cfg.cgroup = read_proto_str(0);
-    cfg.sandbox_id = read_proto_str(0);
-    cfg.stdin_content = read_proto_str(0);
-
-    int count;
-    read_full(0, &count, sizeof(int)); // cmdline
-    for (int i = 0; i < count; ++i)
-      cfg.cmdline.push_back(read_proto_str(0));
-
-    read_full(0, &count, sizeof(int)); // input files
-    for (int i = 0; i < count; ++i) {
-      FileInfo fi;
-      fi.filename = read_proto_str(0);
-      int sz;
-      read_full(0, &sz, sizeof(int));
-      fi.content.resize(sz);
-      if (sz > 0)
-        read_full(0, fi.content.data(), sz);
-      read_full(0, &fi.mode, sizeof(int));
-      cfg.input_files.push_back(fi);
-    }
-
-    read_full(0, &count, sizeof(int)); // output filenames
-    for (int i = 0; i < count; ++i)
-      cfg.output_filenames.push_back(read_proto_str(0));
-
-    // prepare ctx
-    RunContext ctx;
-    ctx.cfg = &cfg;
-    if (pipe2(ctx.child_pipe, O_CLOEXEC) < 0)
-      throw std::runtime_error("pipe");
-    if (pipe2(ctx.result_pipe, O_CLOEXEC) < 0)
-      throw std::runtime_error("pipe");
-
-    // launch namespace container
-    char *stack = new char[STACK_SIZE];
-    int ns_pid = clone(container_init, stack + STACK_SIZE,
-                       CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWIPC |
-                           CLONE_NEWNET | CLONE_NEWUTS | SIGCHLD,
-                       &ctx);
-    if (ns_pid < 0)
-      throw std::runtime_error("clone failed");
-
-    // uid map
+// run one request in a fresh container, which answers on out_fd.
+// one-shot runs (no sandbox) also need their own user namespace, the daemon
+// already owns one
+void run_request(JudgeConfig &cfg, const Sandbox *sandbox, const CpuPin &pin,
+                 int out_fd) {
+  bool new_user = sandbox == nullptr;
+
+  // prepare ctx
+  RunContext ctx;
+  ctx.cfg = &cfg;
+  ctx.sandbox = sandbox;
+  ctx.pin = pin;
+  ctx.out_fd = out_fd;
+  ctx.exec_times = nullptr;
+  if (pipe2(ctx.child_pipe, O_CLOEXEC) < 0)
+    throw std::runtime_error("pipe");
+
+  // launch namespace container
+  int flags = CLONE_NEWNS | CLONE_NEWIPC | CLONE_NEWNET | CLONE_NEWUTS | SIGCHLD;
+  if (new_user)
+    flags |= CLONE_NEWUSER;
+  char *stack = new char[STACK_SIZE];
+  ctx.clone_at = now_us();
+  int ns_pid = clone(container_init, stack + STACK_SIZE, flags, &ctx);
+  if (ns_pid < 0) {
+    delete[] stack;
+    close_pipe(ctx.child_pipe);
+    throw std::runtime_error("clone failed");
+  }
+
+  // uid map
+  long long map_us = 0;
+  if (new_user) {
     try {
-      std::string uid_map = "/proc/" + std::to_string(ns_pid) + "/uid_map";
-      std::string gid_map = "/proc/" + std::to_string(ns_pid) + "/gid_map";
-      write_file("/proc/" + std::to_string(ns_pid) + "/setgroups", "deny");
-      write_file(uid_map, "0 " + std::to_string(getuid()) + " 1");
-      write_file(gid_map, "0 " + std::to_string(getgid()) + " 1");
+      long long map_at = now_us();
+      map_ids(ns_pid);
+      map_us = now_us() - map_at;
     } catch (...) {
       kill(ns_pid, SIGKILL);
+      waitpid(ns_pid, nullptr, 0);
+      delete[] stack;
+      close_pipe(ctx.child_pipe);
       throw;
     }
+  }
 
-    write(ctx.child_pipe[1], "1", 1);
-    close(ctx.child_pipe[0]);
-    close(ctx.child_pipe[1]);
+  write(ctx.child_pipe[1], &map_us, sizeof(map_us));
+  close_pipe(ctx.child_pipe);
 
-    // wait
-    int status;
-    waitpid(ns_pid, &status, 0);
-    delete[] stack;
+  // wait, the container writes its response itself
+  int status;
+  waitpid(ns_pid, &status, 0);
+  delete[] stack;
+
+  int init_status = WIFEXITED(status) ? WEXITSTATUS(status) : INIT_BROKEN;
+  if (init_status == INIT_FAILED)
+    throw std::runtime_error("Failed to set up sandbox");
+  if (init_status != INIT_DONE)
+    throw ProtocolError("Sandbox died mid-response");
+}
 
-    close(ctx.result_pipe[1]);
-
-    int verdict, time, file_cnt;
-    long long memory;
-
-    read_full(ctx.result_pipe[0], &verdict, sizeof(int));
-    read_full(ctx.result_pipe[0], &time, sizeof(int));
-    read_full(ctx.result_pipe[0], &memory, sizeof(long long));
-    std::string stdout_str = read_proto_str(ctx.result_pipe[0]);
-    std::string stderr_str = read_proto_str(ctx.result_pipe[0]);
-
-    read_full(ctx.result_pipe[0], &file_cnt, sizeof(int));
-    std::vector<FileInfo> out_files;
-    for (int i = 0; i < file_cnt; ++i) {
-      FileInfo f;
-      f.filename = read_proto_str(ctx.result_pipe[0]);
-      int sz;
-      read_full(ctx.result_pipe[0], &sz, sizeof(int));
-      f.content.resize(sz);
-      if (sz > 0)
-        read_full(ctx.result_pipe[0], f.content.data(), sz);
-      out_files.push_back(f);
-    }
-
-    // output
-    write_full(1, &verdict, sizeof(int));
-    write_full(1, &time, sizeof(int));
-    write_full(1, &memory, sizeof(long long));
-    write_proto_str(1, stdout_str);
-    write_proto_str(1, stderr_str);
-    write_full(1, &file_cnt, sizeof(int));
-    for (auto &f : out_files) {
-      write_proto_str(1, f.filename);
-      write_proto_buf(1, f.content);
+// daemon
+struct DaemonContext {
+  int barrier[2];
+  JudgeConfig warm; // rootfs/cgroup to prepare before the first request
+  CpuPin pin;
+  std::string id; // names the sandbox after the pid the caller knows
+};
+
+// numa node of a cpu, empty if sysfs doesn't tell
+std::string cpu_node(int cpu) {
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+    return "";
+  std::string node;
+  while (dirent *ent = readdir(dir)) {
+    if (strncmp(ent->d_name, "node", 4) == 0 && isdigit(ent->d_name[4])) {
+      node = ent->d_name + 4;
+      break;
     }
+  }
+  closedir(dir);
+  return node;
+}
+
+int daemon_init(void *arg) {
+  DaemonContext *dctx = (DaemonContext *)arg;
+
+  // a killed caller takes the daemon and its running sandbox along
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  // wait set uid
+  close(dctx->barrier[1]);
+  char ch;
+  if (read(dctx->barrier[0], &ch, 1) <= 0)
+    return 1;
+  close(dctx->barrier[0]);
+
+  // keep the sandbox mounts out of the host namespace
+  if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr))
+    return 1;
+
+  Sandbox sandbox;
+  if (!dctx->warm.rootfs.empty()) {
+    try {
+      prepare_sandbox(sandbox, dctx->warm, dctx->id);
+    } catch (const std::exception &e) {
+      // not fatal, the first request will try again
+      fprintf(stderr, "judger: failed to prepare sandbox: %s\n", e.what());
+    }
+  }
+
+  // serve requests until the caller closes stdin
+  while (true) {
+    JudgeConfig cfg;
+    try {
+      if (!read_config(0, cfg))
+        break;
+    } catch (const ProtocolError &e) {
+      // the stream is out of sync, nothing more can be served
+      fprintf(stderr, "judger: %s\n", e.what());
+      release_sandbox(sandbox);
+      return 1;
+    } catch (const std::exception &e) {
+      write_error(1, e.what());
+      continue;
+    }
+
+    try {
+      prune_cgroups(sandbox, cfg);
+      prepare_sandbox(sandbox, cfg, dctx->id);
+      for (size_t i = 0; i < cfg.runs.size(); ++i)
+        sandbox.stale_cgroups.push_back(run_cgroup(cfg, &sandbox, i));
+      run_request(cfg, &sandbox, dctx->pin, 1);
+    } catch (const ProtocolError &e) {
+      // part of a frame went out already
+      fprintf(stderr, "judger: %s\n", e.what());
+      release_sandbox(sandbox);
+      return 1;
+    } catch (const std::exception &e) {
+      write_error(1, e.what());
+    }
+  }
+
+  release_sandbox(sandbox);
+  return 0;
+}
+
+int run_daemon(const char *rootfs, const char *cgroup, const char *cpu) {
+  DaemonContext dctx;
+  dctx.id = "pool_" + std::to_string(getpid());
+  if (rootfs && cgroup) {
+    dctx.warm.rootfs = {rootfs};
+    dctx.warm.cgroup = cgroup;
+  }
+  if (cpu) {
+    dctx.pin.cpu = atoi(cpu);
+    dctx.pin.mems = cpu_node(dctx.pin.cpu);
+  }
+  int *barrier = dctx.barrier;
+  if (pipe2(barrier, O_CLOEXEC) < 0)
+    throw std::runtime_error("pipe");
+
+  char *stack = new char[STACK_SIZE];
+  int ns_pid = clone(daemon_init, stack + STACK_SIZE,
+                     CLONE_NEWUSER | CLONE_NEWNS | SIGCHLD, &dctx);
+  if (ns_pid < 0)
+    throw std::runtime_error("clone failed");
+
+  try {
+    map_ids(ns_pid);
+  } catch (...) {
+    kill(ns_pid, SIGKILL);
+    throw;
+  }
+
+  write(barrier[1], "1", 1);
+  close(barrier[0]);
+  close(barrier[1]);
 
+  int status;
+  waitpid(ns_pid, &status, 0);
+  delete[] stack;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+  build_syscall_filters();
+
+  // judger --daemon [rootfs cgroup [cpu]]
+  if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+    try {
+      return run_daemon(argc > 3 ? argv[2] : nullptr,
+                        argc > 3 ? argv[3] : nullptr,
+                        argc > 4 ? argv[4] : nullptr);
+    } catch (const std::exception &e) {
+      write_error(1, e.what());
+      return 1;
+    }
+  }
+
+  try {
+    JudgeConfig cfg;
+    if (!read_config(0, cfg))
+      throw std::runtime_error("Read failed or EOF");
+    run_request(cfg, nullptr, CpuPin(), 1);
+  } catch (const ProtocolError &e) {
+    fprintf(stderr, "judger: %s\n", e.what());
+    return 1;
   } catch (const std::exception &e) {
     // UKE
-    int v = VERDICT_UKE, t = 0;
-    long long m = 0;
-    std::string msg = "Internal Error: ";
-    msg += e.what();
-
-    write_full(1, &v, sizeof(int));
-    write_full(1, &t, sizeof(int));
-    write_full(1, &m, sizeof(long long));
-    write_proto_str(1, "");
-    write_proto_str(1, msg); // Stderr
-    int zero = 0;
-    write_full(1, &zero, sizeof(int)); // 0 files
+    write_error(1, e.what());
     return 1;
   }
 
   return 0;
-}
\ No newline at end of file
+}
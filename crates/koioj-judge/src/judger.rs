@@ -1,9 +1,39 @@
 use std::{
-    io::{Cursor, Read, Write},
-    process::{Command, Stdio},
+    io::Write,
+    path::{Path, PathBuf},
+    process::Stdio,
+    sync::{Arc, Mutex},
 };
 
-use koioj_common::error::{Error, Result};
+use crate::metrics;
+use crate::scheduler::{Scheduler, Ticket};
+use koioj_common::{
+    error::{Error, Result},
+    judge::Checker,
+};
+use serde::Deserialize;
+use tokio::{
+    io::{AsyncRead, AsyncReadExt, AsyncWriteExt, BufReader},
+    process::{Child, ChildStdin, ChildStdout, Command},
+    runtime::Handle,
+};
+
+/// Age after which a leftover one-shot sandbox is assumed to be abandoned.
+const STALE_SANDBOX_AGE: tokio::time::Duration = tokio::time::Duration::from_secs(3600);
+
+/// Seccomp profile the program runs under, a filtered run also skips the
+/// per-run net and uts namespaces.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Deserialize)]
+#[serde(rename_all = "camelCase")]
+pub enum SyscallFilter {
+    #[default]
+    None = 0,
+    /// Allowlist for compiled C/C++ programs, anything else kills the program.
+    Native = 1,
+    /// Denylist for interpreters and VMs, denied calls fail with `EPERM`.
+    /// Threads can be started, processes can't.
+    Runtime = 2,
+}
 
 #[derive(Debug, Clone, Copy, PartialEq)]
 pub enum Verdict {
@@ -11,7 +41,9 @@ pub enum Verdict {
     Tle = 1,
     Mle = 2,
     Re = 3,
-    Uke = 5,
+    Uke = 4,
+    Wa = 5,
+    Ole = 6,
 }
 
 impl From<i32> for Verdict {
@@ -21,6 +53,8 @@ impl From<i32> for Verdict {
             1 => Verdict::Tle,
             2 => Verdict::Mle,
             3 => Verdict::Re,
+            5 => Verdict::Wa,
+            6 => Verdict::Ole,
             _ => Verdict::Uke,
         }
     }
@@ -30,17 +64,37 @@ impl From<i32> for Verdict {
 #[allow(dead_code)] // stderr unused
 pub struct JudgerResult {
     pub verdict: Verdict,
-    pub time: i32,
-    pub memory: i64,
+    /// CPU time, user and system, in microseconds.
+    pub time_us: i64,
+    /// Wall time from exec to exit in microseconds.
+    pub wall_time_us: i64,
+    /// Peak memory in bytes, page cache included.
+    pub memory_bytes: i64,
+    /// The program's own memory, anonymous and tmpfs, at its sampled peak.
+    /// `memory_bytes` for a run too short to be sampled.
+    pub anon_bytes: i64,
+    /// Page cache, e.g. of the input the program read, in the same sample.
+    pub file_bytes: i64,
     pub stdout: String,
     pub stderr: String,
+    pub checker_message: String,
     pub output_files: Vec<(String, Vec<u8>)>,
+    /// Microseconds spent in each phase of the run. The first run of a request
+    /// also carries the sandbox setup.
+    pub phases: Vec<(String, u64)>,
+}
+
+#[derive(Clone)]
+pub enum FileSource {
+    Inline(Vec<u8>),
+    /// Absolute host path, bind-mounted read-only into the sandbox.
+    Host(String),
 }
 
 #[derive(Clone)]
 pub struct FileInput {
     pub filename: String,
-    pub content: Vec<u8>,
+    pub source: FileSource,
     pub mode: i32,
 }
 
@@ -48,10 +102,68 @@ impl FileInput {
     pub fn text(filename: &str, content: &str, mode: i32) -> Self {
         FileInput {
             filename: filename.to_string(),
-            content: content.as_bytes().to_vec(),
+            source: FileSource::Inline(content.as_bytes().to_vec()),
             mode,
         }
     }
+
+    pub fn host(filename: &str, path: &str, mode: i32) -> Self {
+        FileInput {
+            filename: filename.to_string(),
+            source: FileSource::Host(path.to_string()),
+            mode,
+        }
+    }
+}
+
+#[derive(Clone)]
+pub struct OutputFile {
+    pub filename: String,
+    /// Copy the file to this absolute host path instead of returning it.
+    pub export_path: Option<String>,
+}
+
+/// One execution of the program within a request.
+#[derive(Clone, Default)]
+pub struct RunInput {
+    pub stdin_content: String,
+    /// Absolute host path read as stdin, takes precedence over `stdin_content`.
+    pub stdin_path: Option<String>,
+    /// Absolute host path receiving stdout, which is then not returned inline.
+    pub stdout_path: Option<String>,
+    /// Expected output checked inside the judger, a mismatch is `Verdict::Wa`.
+    pub answer_path: Option<String>,
+}
+
+/// A sandboxed request, as understood by the judger binary. The sandbox is set
+/// up once and the runs execute in sequence, each in a fresh cgroup and with the
+/// tmpfs reset to the input files in between.
+#[derive(Clone)]
+pub struct JudgerRequest {
+    /// Rootfs layers, the first on top. More than one are stacked with a
+    /// read-only overlayfs.
+    pub rootfs: Vec<String>,
+    pub tmpfs_size: String,
+    pub cgroup: String,
+    pub sandbox_id: String,
+    pub time_limit_ms: i32,
+    pub memory_limit_mb: i64,
+    /// Largest file the program may write, stdout included. Writing past it
+    /// stops the program with `Verdict::Ole`.
+    pub fsize_limit: i64,
+    /// Bytes of stdout and stderr returned inline, the rest is dropped.
+    pub return_limit: i64,
+    pub pids_limit: i32,
+    pub runs: Vec<RunInput>,
+    /// Applies to runs with an `answer_path`.
+    pub checker: Checker,
+    pub cmdline: Vec<String>,
+    pub files: Vec<FileInput>,
+    pub output_files: Vec<OutputFile>,
+    pub syscall_filter: SyscallFilter,
+    /// No throttling below the memory limit and no swap, the first OOM ends
+    /// the run with `Verdict::Mle`.
+    pub strict_memory: bool,
 }
 
 fn write_i32(w: &mut impl Write, v: i32) -> Result<()> {
@@ -64,176 +176,526 @@ fn write_i64(w: &mut impl Write, v: i64) -> Result<()> {
         .map_err(|e| Error::anyhow(e.into()))
 }
 
+fn write_f64(w: &mut impl Write, v: f64) -> Result<()> {
+    w.write_all(&v.to_le_bytes())
+        .map_err(|e| Error::anyhow(e.into()))
+}
+
 fn write_str(w: &mut impl Write, s: &str) -> Result<()> {
     let bytes = s.as_bytes();
-    write_i32(w, bytes.len() as i32)?;
+    write_i64(w, bytes.len() as i64)?;
     w.write_all(bytes).map_err(|e| Error::anyhow(e.into()))
 }
 
-fn read_i32(r: &mut impl Read) -> Result<i32> {
-    let mut buf = [0u8; 4];
-    r.read_exact(&mut buf)?;
-    Ok(i32::from_le_bytes(buf))
-}
-
-fn read_i64(r: &mut impl Read) -> Result<i64> {
-    let mut buf = [0u8; 8];
-    r.read_exact(&mut buf)?;
-    Ok(i64::from_le_bytes(buf))
-}
-
-fn read_string(r: &mut impl Read) -> Result<String> {
-    let len = read_i32(r)?;
-    let mut buf = vec![0u8; len as usize];
-    if len > 0 {
-        r.read_exact(&mut buf)?;
-    }
-    Ok(String::from_utf8_lossy(&buf).to_string())
-}
-
-fn read_bytes(r: &mut impl Read) -> Result<Vec<u8>> {
-    let len = read_i32(r)?;
-    let mut buf = vec![0u8; len as usize];
-    if len > 0 {
-        r.read_exact(&mut buf)?;
-    }
-    Ok(buf)
-}
-
-pub fn run_judger(
-    judger_bin_path: &str,
-    rootfs: &str,
-    tmpfs_size: &str,
-    cgroup: &str,
-    sandbox_id: &str,
-    time_limit_ms: i32,
-    memory_limit_mb: i64,
-    fsize_limit: i64,
-    pids_limit: i32,
-    stdin_content: &str,
-    cmdline: &[&str],
-    files: &[FileInput],
-    output_filenames: &[&str],
-) -> Result<JudgerResult> {
-    let mut child = Command::new(judger_bin_path)
-        .stdin(Stdio::piped())
-        .stdout(Stdio::piped())
-        .stderr(Stdio::inherit())
-        .spawn()?;
-
-    // write
-    {
-        let mut stdin = child.stdin.take().unwrap();
-
-        write_i32(&mut stdin, time_limit_ms)?;
-        write_i64(&mut stdin, memory_limit_mb)?;
-        write_i64(&mut stdin, fsize_limit)?;
-        write_i32(&mut stdin, pids_limit)?;
-        write_str(&mut stdin, rootfs)?;
-        write_str(&mut stdin, tmpfs_size)?;
-        write_str(&mut stdin, cgroup)?;
-        write_str(&mut stdin, sandbox_id)?;
-        write_str(&mut stdin, stdin_content)?;
+/// Every message is one frame: magic, version, type and payload length, then
+/// the payload.
+const PROTO_MAGIC: u32 = 0x504a_4f4b; // "KOJP"
+const PROTO_VERSION: u16 = 6;
+const FRAME_HEADER_LEN: usize = 16;
+/// Largest payload either side accepts, as in judger.cpp.
+const PROTO_MAX_PAYLOAD: u64 = 1 << 32;
+
+const MSG_REQUEST: u16 = 1;
+const MSG_RESULT: u16 = 2;
+const MSG_DONE: u16 = 3;
+const MSG_ERROR: u16 = 4;
+
+fn frame_header(msg_type: u16, len: usize) -> [u8; FRAME_HEADER_LEN] {
+    let mut h = [0u8; FRAME_HEADER_LEN];
+    h[0..4].copy_from_slice(&PROTO_MAGIC.to_le_bytes());
+    h[4..6].copy_from_slice(&PROTO_VERSION.to_le_bytes());
+    h[6..8].copy_from_slice(&msg_type.to_le_bytes());
+    h[8..16].copy_from_slice(&(len as u64).to_le_bytes());
+    h
+}
+
+/// Reads one whole frame, so the payload is parsed from memory.
+async fn read_frame(r: &mut (impl AsyncRead + Unpin)) -> Result<(u16, Vec<u8>)> {
+    let mut h = [0u8; FRAME_HEADER_LEN];
+    r.read_exact(&mut h).await?;
+    let magic = u32::from_le_bytes(h[0..4].try_into().unwrap());
+    let version = u16::from_le_bytes(h[4..6].try_into().unwrap());
+    let msg_type = u16::from_le_bytes(h[6..8].try_into().unwrap());
+    let len = u64::from_le_bytes(h[8..16].try_into().unwrap());
+    if magic != PROTO_MAGIC || version != PROTO_VERSION {
+        return Err(Error::msg(format!(
+            "Bad judger frame: magic {:#x}, version {}",
+            magic, version
+        )));
+    }
+    if len > PROTO_MAX_PAYLOAD {
+        return Err(Error::msg(format!(
+            "Judger frame of {} bytes too large",
+            len
+        )));
+    }
+
+    let mut payload = vec![0u8; len as usize];
+    r.read_exact(&mut payload).await?;
+    Ok((msg_type, payload))
+}
+
+struct Decoder<'a>(&'a [u8]);
+
+impl<'a> Decoder<'a> {
+    fn take(&mut self, n: usize) -> Result<&'a [u8]> {
+        if self.0.len() < n {
+            return Err(Error::msg("Truncated judger message"));
+        }
+        let (head, rest) = self.0.split_at(n);
+        self.0 = rest;
+        Ok(head)
+    }
+
+    fn i32(&mut self) -> Result<i32> {
+        Ok(i32::from_le_bytes(self.take(4)?.try_into().unwrap()))
+    }
+
+    fn i64(&mut self) -> Result<i64> {
+        Ok(i64::from_le_bytes(self.take(8)?.try_into().unwrap()))
+    }
+
+    fn bytes(&mut self) -> Result<Vec<u8>> {
+        let len = self.i64()?.max(0);
+        Ok(self.take(len as usize)?.to_vec())
+    }
+
+    fn string(&mut self) -> Result<String> {
+        let len = self.i64()?.max(0);
+        Ok(String::from_utf8_lossy(self.take(len as usize)?).to_string())
+    }
+}
+
+impl JudgerRequest {
+    /// The whole request frame, written to the judger at once.
+    fn encode(&self) -> Result<Vec<u8>> {
+        let mut buf = vec![0u8; FRAME_HEADER_LEN];
+
+        write_i32(&mut buf, self.time_limit_ms)?;
+        write_i64(&mut buf, self.memory_limit_mb)?;
+        write_i64(&mut buf, self.fsize_limit)?;
+        write_i64(&mut buf, self.return_limit)?;
+        write_i32(&mut buf, self.pids_limit)?;
+        write_i32(&mut buf, self.rootfs.len() as i32)?;
+        for layer in &self.rootfs {
+            write_str(&mut buf, layer)?;
+        }
+        write_str(&mut buf, &self.tmpfs_size)?;
+        write_str(&mut buf, &self.cgroup)?;
+        write_str(&mut buf, &self.sandbox_id)?;
+
+        // runs
+        write_i32(&mut buf, self.runs.len() as i32)?;
+        for run in &self.runs {
+            write_str(&mut buf, &run.stdin_content)?;
+            write_str(&mut buf, run.stdin_path.as_deref().unwrap_or(""))?;
+            write_str(&mut buf, run.stdout_path.as_deref().unwrap_or(""))?;
+            write_str(&mut buf, run.answer_path.as_deref().unwrap_or(""))?;
+        }
+
+        // checker
+        let checked = self.runs.iter().any(|run| run.answer_path.is_some());
+        let (mode, epsilon) = match (checked, self.checker) {
+            (false, _) => (0, 0.0),
+            (true, Checker::Exact) => (1, 0.0),
+            (true, Checker::Token) => (2, 0.0),
+            (true, Checker::Float { epsilon }) => (3, epsilon),
+        };
+        write_i32(&mut buf, mode)?;
+        write_f64(&mut buf, epsilon)?;
 
         // cmdline
-        write_i32(&mut stdin, cmdline.len() as i32)?;
-        for s in cmdline {
-            write_str(&mut stdin, s)?;
+        write_i32(&mut buf, self.cmdline.len() as i32)?;
+        for s in &self.cmdline {
+            write_str(&mut buf, s)?;
         }
 
         // input files
-        write_i32(&mut stdin, files.len() as i32)?;
-        for f in files {
-            write_str(&mut stdin, &f.filename)?;
-            write_i32(&mut stdin, f.content.len() as i32)?;
-            stdin.write_all(&f.content)?;
-            write_i32(&mut stdin, f.mode)?;
+        write_i32(&mut buf, self.files.len() as i32)?;
+        for f in &self.files {
+            write_str(&mut buf, &f.filename)?;
+            match &f.source {
+                FileSource::Inline(content) => {
+                    write_i32(&mut buf, 0)?;
+                    write_i64(&mut buf, content.len() as i64)?;
+                    buf.extend_from_slice(content);
+                }
+                FileSource::Host(path) => {
+                    write_i32(&mut buf, 1)?;
+                    write_str(&mut buf, path)?;
+                }
+            }
+            write_i32(&mut buf, f.mode)?;
         }
 
-        // output filenames
-        write_i32(&mut stdin, output_filenames.len() as i32)?;
-        for s in output_filenames {
-            write_str(&mut stdin, s)?;
+        // output files
+        write_i32(&mut buf, self.output_files.len() as i32)?;
+        for f in &self.output_files {
+            write_str(&mut buf, &f.filename)?;
+            write_str(&mut buf, f.export_path.as_deref().unwrap_or(""))?;
         }
-    }
+        write_i32(&mut buf, self.syscall_filter as i32)?;
+        write_i32(&mut buf, self.strict_memory as i32)?;
 
-    // read output
-    let output = child.wait_with_output()?;
-
-    if !output.status.success() {
-        return Err(Error::msg("Judger process exited abnormally"));
+        let header = frame_header(MSG_REQUEST, buf.len() - FRAME_HEADER_LEN);
+        buf[..FRAME_HEADER_LEN].copy_from_slice(&header);
+        Ok(buf)
     }
+}
 
-    let mut cursor = Cursor::new(output.stdout);
-
-    let verdict = Verdict::from(read_i32(&mut cursor)?);
-    let time = read_i32(&mut cursor)?;
-    let memory = read_i64(&mut cursor)?;
-    let stdout = read_string(&mut cursor)?;
-    let stderr = read_string(&mut cursor)?;
+fn decode_result(payload: &[u8]) -> Result<JudgerResult> {
+    let mut d = Decoder(payload);
+    let verdict = Verdict::from(d.i32()?);
+    let time_us = d.i64()?;
+    let wall_time_us = d.i64()?;
+    let memory_bytes = d.i64()?;
+    let stdout = d.string()?;
+    let stderr = d.string()?;
+    let checker_message = d.string()?;
 
-    let files_cnt = read_i32(&mut cursor)?;
+    let files_cnt = d.i32()?.max(0);
     let mut output_files = Vec::with_capacity(files_cnt as usize);
     for _ in 0..files_cnt {
-        let name = read_string(&mut cursor)?;
-        let content = read_bytes(&mut cursor)?;
+        let name = d.string()?;
+        let content = d.bytes()?;
         output_files.push((name, content));
     }
 
+    // optional trailer
+    let mut phases = Vec::new();
+    let mut anon_bytes = memory_bytes;
+    let mut file_bytes = 0;
+    if !d.0.is_empty() {
+        for _ in 0..d.i32()?.max(0) {
+            let name = d.string()?;
+            phases.push((name, d.i64()?.max(0) as u64));
+        }
+        anon_bytes = d.i64()?;
+        file_bytes = d.i64()?;
+    }
+
     Ok(JudgerResult {
         verdict,
-        time,
-        memory,
+        time_us,
+        wall_time_us,
+        memory_bytes,
+        anon_bytes,
+        file_bytes,
         stdout,
         stderr,
+        checker_message,
         output_files,
+        phases,
     })
 }
 
-pub async fn run_judger_async(
-    judger_bin_path: &str,
-    rootfs: &str,
-    tmpfs_size: &str,
-    cgroup: &str,
-    sandbox_id: &str,
-    time_limit_ms: i32,
-    memory_limit_mb: i64,
-    fsize_limit: i64,
-    pids_limit: i32,
-    stdin_content: &str,
-    cmdline: &[&str],
-    files: &[FileInput],
-    output_filenames: &[&str],
-) -> Result<JudgerResult> {
-    let judger_bin_path = judger_bin_path.to_string();
-    let rootfs = rootfs.to_string();
-    let tmpfs_size = tmpfs_size.to_string();
-    let cgroup = cgroup.to_string();
-    let sandbox_id = sandbox_id.to_string();
-    let stdin_content = stdin_content.to_string();
-    let cmdline: Vec<String> = cmdline.iter().map(|s| s.to_string()).collect();
-    let files = files.to_vec();
-    let output_filenames: Vec<String> = output_filenames.iter().map(|s| s.to_string()).collect();
-
-    tokio::task::spawn_blocking(move || {
-        let cmdline_refs: Vec<&str> = cmdline.iter().map(|s| s.as_str()).collect();
-        let output_refs: Vec<&str> = output_filenames.iter().map(|s| s.as_str()).collect();
-
-        run_judger(
-            &judger_bin_path,
-            &rootfs,
-            &tmpfs_size,
-            &cgroup,
-            &sandbox_id,
-            time_limit_ms,
-            memory_limit_mb,
-            fsize_limit,
-            pids_limit,
-            &stdin_content,
-            &cmdline_refs,
-            &files,
-            &output_refs,
-        )
-    })
-    .await?
+/// Reads the frames of one response. The inner error is a request the judger
+/// rejected as a whole, which leaves the stream in sync.
+async fn read_response(
+    r: &mut (impl AsyncRead + Unpin),
+) -> Result<std::result::Result<Vec<JudgerResult>, String>> {
+    let mut results = Vec::new();
+    loop {
+        let (msg_type, payload) = read_frame(r).await?;
+        match msg_type {
+            MSG_RESULT => results.push(decode_result(&payload)?),
+            MSG_DONE => return Ok(Ok(results)),
+            MSG_ERROR => return Ok(Err(Decoder(&payload).string()?)),
+            _ => {
+                return Err(Error::msg(format!(
+                    "Unexpected judger message type {}",
+                    msg_type
+                )));
+            }
+        }
+    }
+}
+
+/// A long-lived `judger --daemon` process. It sets up its user namespace and a
+/// read-only rootfs mount per layer set once, then serves requests one at a
+/// time over its stdin/stdout with only the tmpfs and the run cgroup recreated
+/// per request.
+struct JudgerDaemon {
+    child: Child,
+    stdin: ChildStdin,
+    stdout: BufReader<ChildStdout>,
+    /// Sandbox cgroup and root of the daemon, the judger names them after its
+    /// pid.
+    sandbox: Option<(PathBuf, PathBuf)>,
+}
+
+impl JudgerDaemon {
+    fn spawn(
+        judger_bin_path: &str,
+        rootfs: &str,
+        cgroup: &str,
+        cpu: Option<usize>,
+    ) -> Result<Self> {
+        let mut cmd = Command::new(judger_bin_path);
+        cmd.args(["--daemon", rootfs, cgroup]);
+        if let Some(cpu) = cpu {
+            cmd.arg(cpu.to_string());
+        }
+        let mut child = cmd
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .stderr(Stdio::inherit())
+            .kill_on_drop(true)
+            .spawn()?;
+
+        let stdin = child.stdin.take().unwrap();
+        let stdout = BufReader::new(child.stdout.take().unwrap());
+        let sandbox = child.id().map(|pid| {
+            (
+                Path::new(cgroup).join(format!("judge.pool_{}", pid)),
+                PathBuf::from(format!("/tmp/judger_sandbox_pool_{}", pid)),
+            )
+        });
+        Ok(Self {
+            child,
+            stdin,
+            stdout,
+            sandbox,
+        })
+    }
+
+    async fn run(&mut self, req: &[u8]) -> Result<std::result::Result<Vec<JudgerResult>, String>> {
+        self.stdin.write_all(req).await?;
+        self.stdin.flush().await?;
+        read_response(&mut self.stdout).await
+    }
+}
+
+// a daemon killed mid-run, e.g. because its run was cancelled, takes its
+// sandbox processes along but can't clean up after them any more
+impl Drop for JudgerDaemon {
+    fn drop(&mut self) {
+        let _ = self.child.start_kill();
+        if let (Some((cgroup, root)), Ok(rt)) = (self.sandbox.take(), Handle::try_current()) {
+            rt.spawn(remove_sandbox(cgroup, root));
+        }
+    }
+}
+
+/// Kills whatever is left in a daemon's sandbox cgroup, then removes it along
+/// with its run cgroups once they are empty, and the sandbox root.
+async fn remove_sandbox(cgroup: PathBuf, root: PathBuf) {
+    // needs linux 5.14, without it the sandboxes still die with the daemon
+    let _ = tokio::fs::write(cgroup.join("cgroup.kill"), "1").await;
+    for _ in 0..50 {
+        if let Ok(mut dir) = tokio::fs::read_dir(&cgroup).await {
+            while let Ok(Some(entry)) = dir.next_entry().await {
+                if entry.file_type().await.is_ok_and(|t| t.is_dir()) {
+                    let _ = tokio::fs::remove_dir(entry.path()).await;
+                }
+            }
+        }
+        // busy until the killed processes are reaped
+        match tokio::fs::remove_dir(&cgroup).await {
+            Err(e) if e.kind() != std::io::ErrorKind::NotFound => {
+                tokio::time::sleep(tokio::time::Duration::from_millis(20)).await
+            }
+            _ => {
+                // the rootfs mounts below it were in the daemon's own mount
+                // namespace, here they are empty directories
+                let _ = tokio::fs::remove_dir_all(&root).await;
+                return;
+            }
+        }
+    }
+    tracing::warn!("Failed to remove sandbox cgroup {}", cgroup.display());
+}
+
+/// Sandboxes left behind by a previous judge that was killed before it could
+/// remove them. A daemon's sandbox is stale once its pid is gone, anything else
+/// (one-shot runs) once it hasn't been touched for an hour.
+async fn reap_stale_sandboxes(cgroup: PathBuf, live: Vec<u32>) {
+    let is_stale = |pid: Option<u32>, path: &Path| match pid {
+        Some(pid) => !live.contains(&pid) && !Path::new(&format!("/proc/{}", pid)).exists(),
+        None => std::fs::metadata(path)
+            .and_then(|m| m.modified())
+            .is_ok_and(|t| t.elapsed().unwrap_or_default() > STALE_SANDBOX_AGE),
+    };
+    let pool_pid = |name: &str| name.strip_prefix("pool_").and_then(|pid| pid.parse().ok());
+
+    if let Ok(mut dir) = tokio::fs::read_dir(&cgroup).await {
+        while let Ok(Some(entry)) = dir.next_entry().await {
+            let name = entry.file_name().to_string_lossy().into_owned();
+            let Some(id) = name.strip_prefix("judge.") else {
+                continue;
+            };
+            if is_stale(pool_pid(id), &entry.path()) {
+                tracing::info!("Reaping stale sandbox cgroup {}", entry.path().display());
+                tokio::spawn(remove_sandbox(
+                    entry.path(),
+                    PathBuf::from(format!("/tmp/judger_sandbox_{}", id)),
+                ));
+            }
+        }
+    }
+    // roots whose cgroup is gone already, or were never given one
+    if let Ok(mut dir) = tokio::fs::read_dir("/tmp").await {
+        while let Ok(Some(entry)) = dir.next_entry().await {
+            let name = entry.file_name().to_string_lossy().into_owned();
+            let Some(id) = name.strip_prefix("judger_sandbox_") else {
+                continue;
+            };
+            if is_stale(pool_pid(id), &entry.path()) {
+                let _ = tokio::fs::remove_dir_all(entry.path()).await;
+            }
+        }
+    }
+}
+
+/// Cores listed in `/sys/devices/system/cpu/online`, e.g. `0-3,6`.
+pub fn online_cpus() -> Vec<usize> {
+    let Ok(list) = std::fs::read_to_string("/sys/devices/system/cpu/online") else {
+        return Vec::new();
+    };
+    let mut cpus = Vec::new();
+    for range in list.trim().split(',').filter(|r| !r.is_empty()) {
+        let (lo, hi) = range.split_once('-').unwrap_or((range, range));
+        if let (Ok(lo), Ok(hi)) = (lo.parse::<usize>(), hi.parse::<usize>()) {
+            cpus.extend(lo..=hi);
+        }
+    }
+    cpus
+}
+
+/// A pool position with its own core, the daemon is respawned on failure.
+struct Slot {
+    cpu: Option<usize>,
+    daemon: Option<JudgerDaemon>,
+}
+
+/// Returns a taken slot to the pool, also when the run holding it is dropped.
+struct SlotGuard<'a> {
+    idle: &'a Mutex<Vec<Slot>>,
+    slot: Slot,
+}
+
+impl Drop for SlotGuard<'_> {
+    fn drop(&mut self) {
+        let slot = Slot {
+            cpu: self.slot.cpu,
+            daemon: self.slot.daemon.take(),
+        };
+        self.idle.lock().unwrap().push(slot);
+    }
+}
+
+/// Bounded pool of judger daemons. Each daemon serves one run at a time, so the
+/// pool size is also the number of concurrent sandboxes on this node. Requests
+/// waiting for a daemon are served by their ticket. With
+/// `cpus` given, each daemon pins its sandboxes to a core of its own, so runs
+/// never share a physical CPU and their timings stay comparable.
+pub struct JudgerPool {
+    judger_bin_path: String,
+    rootfs: String,
+    cgroup: String,
+    idle: Mutex<Vec<Slot>>,
+    slots: Arc<Scheduler>,
+    size: usize,
+}
+
+impl JudgerPool {
+    /// Spawns all daemons up front so their sandboxes are ready before the
+    /// first submission arrives, and reaps the ones an earlier judge left
+    /// behind in the background. Must be called within a tokio runtime.
+    pub fn new(
+        judger_bin_path: String,
+        size: usize,
+        rootfs: String,
+        cgroup: String,
+        cpus: &[usize],
+    ) -> Self {
+        let mut idle = Vec::with_capacity(size);
+        let mut spawn = true;
+        for i in 0..size {
+            let cpu = cpus.get(i).copied();
+            let daemon = if spawn {
+                JudgerDaemon::spawn(&judger_bin_path, &rootfs, &cgroup, cpu)
+                    .inspect_err(|e| {
+                        tracing::warn!("Failed to pre-spawn judger daemon: {:?}", e);
+                        spawn = false;
+                    })
+                    .ok()
+            } else {
+                None
+            };
+            idle.push(Slot { cpu, daemon });
+        }
+
+        let live = idle
+            .iter()
+            .filter_map(|slot| slot.daemon.as_ref().and_then(|d| d.child.id()))
+            .collect();
+        Handle::current().spawn(reap_stale_sandboxes(PathBuf::from(&cgroup), live));
+
+        Self {
+            judger_bin_path,
+            rootfs,
+            cgroup,
+            idle: Mutex::new(idle),
+            slots: Scheduler::new(size),
+            size,
+        }
+    }
+
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    /// Slots not running a request right now.
+    pub fn free_slots(&self) -> usize {
+        self.slots.free_slots()
+    }
+
+    /// Returns one result per run, in order.
+    pub async fn run(&self, req: &JudgerRequest, ticket: Ticket) -> Result<Vec<JudgerResult>> {
+        let runs = req.runs.len();
+        let req = req.encode()?;
+        let _permit = self.slots.acquire(ticket).await;
+
+        // every permit leaves a slot in the idle list
+        let slot = self
+            .idle
+            .lock()
+            .unwrap()
+            .pop()
+            .ok_or_else(|| Error::msg("No judger slot available"))?;
+        let mut slot = SlotGuard {
+            idle: &self.idle,
+            slot,
+        };
+        let mut daemon = match slot.slot.daemon.take() {
+            Some(daemon) => daemon,
+            None => JudgerDaemon::spawn(
+                &self.judger_bin_path,
+                &self.rootfs,
+                &self.cgroup,
+                slot.slot.cpu,
+            )?,
+        };
+
+        // a daemon that failed or was cancelled mid-request is out of sync,
+        // drop (and kill) it
+        let response = daemon.run(&req).await?;
+        slot.slot.daemon = Some(daemon);
+        drop(slot);
+
+        let results = response.map_err(|e| Error::msg(format!("Judger request failed: {}", e)))?;
+        for result in &results {
+            metrics::JUDGER_PHASES.record(&result.phases);
+            metrics::NODE_COUNTERS.record_run(&result.phases);
+        }
+        if results.len() != runs {
+            return Err(Error::msg(format!(
+                "Judger request failed: {} results for {} runs",
+                results.len(),
+                runs
+            )));
+        }
+        Ok(results)
+    }
 }
@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+//
+// https://github.com/ParaN3xus/koioj
+// Copyright (C) 2025 ParaN3xus <paran3xus007@gmail.com>
+
+// judger_bench, drives a judger with synthetic workloads and reports the end
+// to end latency and throughput of its requests at several concurrency levels
+//
+// judger_bench [-n requests] [-c 1,2,4,8] [-w true,echo_1m,...] [--oneshot]
+//              [-f none|native|runtime] [--strict-memory]
+//              <judger> <rootfs> <cgroup>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <limits.h>
+#include <signal.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// must match judger.cpp
+const uint32_t PROTO_MAGIC = 0x504a4f4b;
+const uint16_t PROTO_VERSION = 5;
+
+enum MessageType {
+  MSG_REQUEST = 1,
+  MSG_RESULT = 2,
+  MSG_DONE = 3,
+  MSG_ERROR = 4,
+};
+
+struct FrameHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t type;
+  uint64_t length;
+};
+
+const int VERDICT_ANY = -1;
+const int VERDICT_OK = 0;
+const int VERDICT_TLE = 1;
+
+struct Workload {
+  std::string name;
+  std::vector<std::string> cmdline;
+  std::string stdin_content;
+  std::string host_file; // bound into the sandbox as ./<basename>
+  int time_limit = 1000;
+  long long memory_limit = 256;
+  long long fsize_limit = 64LL << 20;
+  int pids_limit = 16;
+  std::string tmpfs_size = "64M";
+  int expect = VERDICT_OK;
+};
+
+struct Options {
+  std::string judger, rootfs, cgroup;
+  int requests = 50;
+  std::vector<int> concurrency = {1, 2, 4, 8};
+  std::vector<std::string> workloads;
+  bool oneshot = false;
+  int syscall_filter = 0; // SyscallFilter of judger.cpp
+  bool strict_memory = false;
+};
+
+// utils
+void write_full(int fd, const void *buf, size_t size) {
+  size_t total = 0;
+  while (total < size) {
+    ssize_t ret = write(fd, (const char *)buf + total, size - total);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error("Write failed");
+    }
+    total += ret;
+  }
+}
+
+void read_full(int fd, void *buf, size_t size) {
+  size_t total = 0;
+  while (total < size) {
+    ssize_t ret = read(fd, (char *)buf + total, size - total);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR)
+        continue;
+      throw std::runtime_error("Read failed or EOF");
+    }
+    total += ret;
+  }
+}
+
+std::vector<std::string> split(const std::string &s, char sep) {
+  std::vector<std::string> parts;
+  std::stringstream ss(s);
+  std::string part;
+  while (std::getline(ss, part, sep))
+    if (!part.empty())
+      parts.push_back(part);
+  return parts;
+}
+
+// a path inside rootfs, absolute symlinks resolved against rootfs as well
+std::string resolve_in_rootfs(const std::string &rootfs, std::string path) {
+  for (int depth = 0; depth < 8; ++depth) {
+    char target[PATH_MAX];
+    ssize_t n = readlink((rootfs + path).c_str(), target, sizeof(target) - 1);
+    if (n < 0)
+      break;
+    target[n] = '\0';
+    if (target[0] == '/')
+      path = target;
+    else
+      path = path.substr(0, path.rfind('/') + 1) + target;
+  }
+  return rootfs + path;
+}
+
+// request
+struct Encoder {
+  std::string buf;
+
+  void put(const void *p, size_t n) { buf.append((const char *)p, n); }
+  void i32(int v) { put(&v, sizeof(int)); }
+  void i64(long long v) { put(&v, sizeof(long long)); }
+  void f64(double v) { put(&v, sizeof(double)); }
+  void str(const std::string &s) {
+    i64(s.size());
+    buf += s;
+  }
+};
+
+std::string encode_request(const Workload &w, const Options &opt,
+                           const std::string &sandbox_id) {
+  Encoder enc;
+  enc.put("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", sizeof(FrameHeader));
+  enc.i32(w.time_limit);
+  enc.i64(w.memory_limit);
+  enc.i64(w.fsize_limit);
+  enc.i64(64 << 10); // return limit, as the judge sets it
+  enc.i32(w.pids_limit);
+  enc.i32(1); // rootfs layers
+  enc.str(opt.rootfs);
+  enc.str(w.tmpfs_size);
+  enc.str(opt.cgroup);
+  enc.str(sandbox_id);
+
+  enc.i32(1); // runs
+  enc.str(w.stdin_content);
+  enc.str("");
+  enc.str("");
+  enc.str("");
+  enc.i32(0); // no checker
+  enc.f64(0);
+
+  enc.i32(w.cmdline.size());
+  for (const auto &s : w.cmdline)
+    enc.str(s);
+
+  if (w.host_file.empty()) {
+    enc.i32(0);
+  } else {
+    enc.i32(1);
+    enc.str(w.host_file.substr(w.host_file.rfind('/') + 1));
+    enc.i32(1); // host file
+    enc.str(w.host_file);
+    enc.i32(0755);
+  }
+  enc.i32(0); // output files
+  enc.i32(opt.syscall_filter);
+  enc.i32(opt.strict_memory);
+
+  FrameHeader h = {PROTO_MAGIC, PROTO_VERSION, MSG_REQUEST,
+                   enc.buf.size() - sizeof(FrameHeader)};
+  memcpy(&enc.buf[0], &h, sizeof(h));
+  return enc.buf;
+}
+
+// verdict of the first run, throws on an error reply
+int read_response(int fd) {
+  int verdict = VERDICT_ANY;
+  std::string payload;
+  while (true) {
+    FrameHeader h;
+    read_full(fd, &h, sizeof(h));
+    if (h.magic != PROTO_MAGIC || h.version != PROTO_VERSION)
+      throw std::runtime_error("Bad frame header");
+    payload.resize(h.length);
+    read_full(fd, &payload[0], h.length);
+    if (h.type == MSG_RESULT && verdict == VERDICT_ANY &&
+        h.length >= sizeof(int))
+      memcpy(&verdict, payload.data(), sizeof(int));
+    else if (h.type == MSG_DONE)
+      return verdict;
+    else if (h.type == MSG_ERROR)
+      throw std::runtime_error(
+          "Judger error: " + payload.substr(std::min<size_t>(8, h.length)));
+  }
+}
+
+// a judger process talking over a pair of pipes
+struct Judger {
+  pid_t pid = -1;
+  int in = -1, out = -1;
+
+  void spawn(const Options &opt, bool daemon) {
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) < 0 || pipe2(from, O_CLOEXEC) < 0)
+      throw std::runtime_error("pipe");
+    pid = fork();
+    if (pid < 0)
+      throw std::runtime_error("fork");
+    if (pid == 0) {
+      dup2(to[0], STDIN_FILENO);
+      dup2(from[1], STDOUT_FILENO);
+      if (daemon)
+        execl(opt.judger.c_str(), opt.judger.c_str(), "--daemon",
+              opt.rootfs.c_str(), opt.cgroup.c_str(), (char *)nullptr);
+      else
+        execl(opt.judger.c_str(), opt.judger.c_str(), (char *)nullptr);
+      _exit(127);
+    }
+    close(to[0]);
+    close(from[1]);
+    in = to[1];
+    out = from[0];
+  }
+
+  int request(const std::string &req) {
+    write_full(in, req.data(), req.size());
+    return read_response(out);
+  }
+
+  void stop() {
+    if (pid < 0)
+      return;
+    close(in);
+    close(out);
+    waitpid(pid, nullptr, 0);
+    pid = -1;
+  }
+};
+
+// bench
+struct Sample {
+  double ms;
+  bool failed;
+};
+
+void worker(const Workload &w, const Options &opt, int id, int count,
+            std::vector<Sample> &samples) {
+  Judger daemon;
+  if (!opt.oneshot) {
+    daemon.spawn(opt, true);
+    // warm up, the first request also prepares the sandbox
+    try {
+      daemon.request(encode_request(w, opt, "bench_" + std::to_string(id)));
+    } catch (...) {
+    }
+  }
+
+  for (int i = 0; i < count; ++i) {
+    std::string sandbox_id =
+        "bench_" + std::to_string(id) + "_" + std::to_string(i);
+    std::string req = encode_request(w, opt, sandbox_id);
+
+    auto start = std::chrono::steady_clock::now();
+    bool failed = false;
+    try {
+      int verdict;
+      if (opt.oneshot) {
+        Judger judger;
+        judger.spawn(opt, false);
+        verdict = judger.request(req);
+        judger.stop();
+      } else {
+        verdict = daemon.request(req);
+      }
+      failed = w.expect != VERDICT_ANY && verdict != w.expect;
+    } catch (const std::exception &e) {
+      fprintf(stderr, "judger_bench: %s\n", e.what());
+      failed = true;
+      if (!opt.oneshot) {
+        daemon.stop();
+        daemon.spawn(opt, true);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    samples.push_back(
+        {std::chrono::duration<double, std::milli>(end - start).count(),
+         failed});
+  }
+
+  daemon.stop();
+}
+
+double percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+  return sorted[idx];
+}
+
+void bench(const Workload &w, const Options &opt, int conc) {
+  std::vector<std::vector<Sample>> samples(conc);
+  std::vector<std::thread> threads;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < conc; ++t) {
+    // spread the requests, the first workers take the remainder
+    int count = opt.requests / conc + (t < opt.requests % conc ? 1 : 0);
+    threads.emplace_back(worker, std::cref(w), std::cref(opt), t, count,
+                         std::ref(samples[t]));
+  }
+  for (auto &t : threads)
+    t.join();
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  std::vector<double> ms;
+  int failed = 0;
+  for (const auto &s : samples)
+    for (const auto &sample : s) {
+      ms.push_back(sample.ms);
+      failed += sample.failed;
+    }
+  std::sort(ms.begin(), ms.end());
+
+  printf("%-12s %5d %6zu %6d %9.2f %9.2f %9.1f\n", w.name.c_str(), conc,
+         ms.size(), failed, percentile(ms, 0.5), percentile(ms, 0.99),
+         secs > 0 ? ms.size() / secs : 0);
+  fflush(stdout);
+}
+
+// workloads
+std::vector<Workload> make_workloads(const Options &opt,
+                                     const std::string &work_dir) {
+  std::vector<Workload> all;
+
+  Workload w;
+  w.name = "true";
+  w.cmdline = {"/bin/true"};
+  all.push_back(w);
+
+  w = Workload();
+  w.name = "echo_1m";
+  w.cmdline = {"/bin/cat"};
+  w.stdin_content.assign(1 << 20, 'a');
+  all.push_back(w);
+
+  w = Workload();
+  w.name = "output_100m";
+  w.cmdline = {"/bin/sh", "-c", "yes | head -c 104857600"};
+  w.time_limit = 10000;
+  w.memory_limit = 512;
+  w.fsize_limit = 128LL << 20;
+  w.tmpfs_size = "256M";
+  all.push_back(w);
+
+  // keeps forking into pids.max until the time limit
+  w = Workload();
+  w.name = "fork_bomb";
+  w.cmdline = {"/bin/sh", "-c", "while :; do /bin/true & done"};
+  w.time_limit = 500;
+  w.expect = VERDICT_TLE;
+  all.push_back(w);
+
+  // true, padded like a large compiled program and handed in by path
+  w = Workload();
+  w.name = "big_binary";
+  w.host_file = work_dir + "/true";
+  w.cmdline = {"./true"};
+  std::ifstream src(resolve_in_rootfs(opt.rootfs, "/bin/true"),
+                    std::ios::binary);
+  std::ofstream dst(w.host_file, std::ios::binary);
+  dst << src.rdbuf();
+  std::string pad(1 << 20, '\0');
+  for (int i = 0; i < 64; ++i)
+    dst.write(pad.data(), pad.size());
+  dst.close();
+  chmod(w.host_file.c_str(), 0755);
+  all.push_back(w);
+
+  return all;
+}
+
+void usage() {
+  fprintf(stderr, "usage: judger_bench [-n requests] [-c 1,2,4,8] "
+                  "[-w true,echo_1m,output_100m,fork_bomb,big_binary] "
+                  "[--oneshot] [-f none|native|runtime] [--strict-memory] "
+                  "<judger> <rootfs> <cgroup>\n");
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  Options opt;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--oneshot") {
+      opt.oneshot = true;
+    } else if (arg == "--strict-memory") {
+      opt.strict_memory = true;
+    } else if ((arg == "-n" || arg == "-c" || arg == "-w" || arg == "-f") &&
+               i + 1 < argc) {
+      std::string val = argv[++i];
+      if (arg == "-f") {
+        const char *filters[] = {"none", "native", "runtime"};
+        auto it = std::find(std::begin(filters), std::end(filters), val);
+        if (it == std::end(filters)) {
+          usage();
+          return 1;
+        }
+        opt.syscall_filter = it - std::begin(filters);
+      } else if (arg == "-n") {
+        opt.requests = std::max(1, atoi(val.c_str()));
+      } else if (arg == "-c") {
+        opt.concurrency.clear();
+        for (const auto &c : split(val, ','))
+          opt.concurrency.push_back(std::max(1, atoi(c.c_str())));
+      } else {
+        opt.workloads = split(val, ',');
+      }
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.size() != 3) {
+    usage();
+    return 1;
+  }
+  char judger[PATH_MAX], rootfs[PATH_MAX];
+  if (!realpath(args[0].c_str(), judger) ||
+      !realpath(args[1].c_str(), rootfs)) {
+    fprintf(stderr, "judger_bench: no such judger or rootfs\n");
+    return 1;
+  }
+  opt.judger = judger;
+  opt.rootfs = rootfs;
+  opt.cgroup = args[2];
+
+  std::string work_dir = "/tmp/judger_bench." + std::to_string(getpid());
+  if (mkdir(work_dir.c_str(), 0755)) {
+    fprintf(stderr, "judger_bench: failed to create %s\n", work_dir.c_str());
+    return 1;
+  }
+
+  std::vector<Workload> workloads = make_workloads(opt, work_dir);
+  printf("%-12s %5s %6s %6s %9s %9s %9s\n", "workload", "conc", "reqs",
+         "failed", "p50 ms", "p99 ms", "req/s");
+  for (const auto &w : workloads) {
+    if (!opt.workloads.empty() &&
+        std::find(opt.workloads.begin(), opt.workloads.end(), w.name) ==
+            opt.workloads.end())
+      continue;
+    for (int conc : opt.concurrency)
+      bench(w, opt, conc);
+  }
+
+  unlink((work_dir + "/true").c_str());
+  rmdir(work_dir.c_str());
+  return 0;
+}
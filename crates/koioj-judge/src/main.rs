@@ -1,9 +1,14 @@
 // koioj-judge/src/main.rs
 
+mod baseline;
+mod compile_cache;
 mod config;
 mod judge;
 mod judger;
+mod metrics;
 mod sandbox;
+mod scheduler;
+mod testdata;
 mod websocket;
 
 use clap::{Parser, Subcommand};
@@ -44,6 +49,13 @@ async fn main() -> Result<()> {
 
     match cli.command {
         Commands::Serve => {
+            if let Some(listen) = config.metrics_listen.clone() {
+                tokio::spawn(async move {
+                    if let Err(e) = metrics::serve(&listen).await {
+                        tracing::error!("Metrics server failed: {:?}", e);
+                    }
+                });
+            }
             websocket::run(config).await?;
         }
         Commands::InstallSandbox => {
@@ -0,0 +1,189 @@
+// koioj-judge/src/metrics.rs
+
+use std::{
+    collections::BTreeMap,
+    fmt::Write,
+    sync::{
+        Mutex,
+        atomic::{AtomicU64, Ordering},
+    },
+};
+
+use axum::{Router, routing::get};
+use koioj_common::error::Result;
+use tokio::net::TcpListener;
+
+/// Upper bounds of the histogram buckets, in microseconds.
+const BUCKETS_US: [u64; 16] = [
+    50, 100, 250, 500, 1_000, 2_500, 5_000, 10_000, 25_000, 50_000, 100_000, 250_000, 500_000,
+    1_000_000, 2_500_000, 5_000_000,
+];
+
+#[derive(Default)]
+struct Histogram {
+    buckets: [u64; BUCKETS_US.len()],
+    sum_us: u64,
+    count: u64,
+}
+
+/// Latency histograms keyed by phase name.
+pub struct PhaseHistograms {
+    name: &'static str,
+    help: &'static str,
+    phases: Mutex<BTreeMap<String, Histogram>>,
+}
+
+/// Time the judger spent in each phase of a sandboxed run.
+pub static JUDGER_PHASES: PhaseHistograms = PhaseHistograms::new(
+    "koioj_judger_phase_seconds",
+    "Time spent in each phase of a judger run.",
+);
+
+impl PhaseHistograms {
+    const fn new(name: &'static str, help: &'static str) -> Self {
+        Self {
+            name,
+            help,
+            phases: Mutex::new(BTreeMap::new()),
+        }
+    }
+
+    pub fn record(&self, phases: &[(String, u64)]) {
+        let mut map = self.phases.lock().unwrap();
+        for (phase, us) in phases {
+            let h = map.entry(phase.clone()).or_default();
+            if let Some(i) = BUCKETS_US.iter().position(|le| us <= le) {
+                h.buckets[i] += 1;
+            }
+            h.sum_us += us;
+            h.count += 1;
+        }
+    }
+
+    /// Prometheus text exposition format.
+    fn render(&self, out: &mut String) {
+        let map = self.phases.lock().unwrap();
+        let _ = writeln!(out, "# HELP {} {}", self.name, self.help);
+        let _ = writeln!(out, "# TYPE {} histogram", self.name);
+        for (phase, h) in map.iter() {
+            let mut cumulative = 0;
+            for (le, n) in BUCKETS_US.iter().zip(h.buckets) {
+                cumulative += n;
+                let _ = writeln!(
+                    out,
+                    "{}_bucket{{phase=\"{}\",le=\"{}\"}} {}",
+                    self.name,
+                    phase,
+                    *le as f64 / 1e6,
+                    cumulative
+                );
+            }
+            let _ = writeln!(
+                out,
+                "{}_bucket{{phase=\"{}\",le=\"+Inf\"}} {}",
+                self.name, phase, h.count
+            );
+            let _ = writeln!(
+                out,
+                "{}_sum{{phase=\"{}\"}} {}",
+                self.name,
+                phase,
+                h.sum_us as f64 / 1e6
+            );
+            let _ = writeln!(
+                out,
+                "{}_count{{phase=\"{}\"}} {}",
+                self.name, phase, h.count
+            );
+        }
+    }
+}
+
+/// Histogram that is emptied whenever it is read, lock-free to record into.
+pub struct LatencyWindow {
+    buckets: [AtomicU64; BUCKETS_US.len() + 1], // the last one unbounded
+}
+
+impl LatencyWindow {
+    const fn new() -> Self {
+        Self {
+            buckets: [const { AtomicU64::new(0) }; BUCKETS_US.len() + 1],
+        }
+    }
+
+    pub fn record(&self, us: u64) {
+        let i = BUCKETS_US
+            .iter()
+            .position(|le| us <= *le)
+            .unwrap_or(BUCKETS_US.len());
+        self.buckets[i].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Upper bound of the bucket holding the 99th percentile of what was
+    /// recorded since the last call, 0 if nothing was.
+    pub fn take_p99(&self) -> u64 {
+        let counts: Vec<u64> = self
+            .buckets
+            .iter()
+            .map(|b| b.swap(0, Ordering::Relaxed))
+            .collect();
+        let total: u64 = counts.iter().sum();
+        if total == 0 {
+            return 0;
+        }
+        let mut cumulative = 0;
+        for (i, n) in counts.iter().enumerate() {
+            cumulative += n;
+            if cumulative * 100 >= total * 99 {
+                return BUCKETS_US
+                    .get(i)
+                    .copied()
+                    .unwrap_or(BUCKETS_US[BUCKETS_US.len() - 1]);
+            }
+        }
+        unreachable!()
+    }
+}
+
+/// Figures of this node reported to the API with every ping, which reset
+/// them.
+pub struct NodeCounters {
+    pub runs: AtomicU64,
+    /// Sandbox setup of a run, everything before the program starts.
+    pub setup: LatencyWindow,
+    /// Time a task waited for the executor to take it.
+    pub queue_wait: LatencyWindow,
+}
+
+pub static NODE_COUNTERS: NodeCounters = NodeCounters {
+    runs: AtomicU64::new(0),
+    setup: LatencyWindow::new(),
+    queue_wait: LatencyWindow::new(),
+};
+
+impl NodeCounters {
+    pub fn record_run(&self, phases: &[(String, u64)]) {
+        self.runs.fetch_add(1, Ordering::Relaxed);
+        let setup = phases
+            .iter()
+            .filter(|(phase, _)| phase != "run" && phase != "collect")
+            .map(|(_, us)| us)
+            .sum();
+        self.setup.record(setup);
+    }
+}
+
+async fn metrics() -> String {
+    let mut out = String::new();
+    JUDGER_PHASES.render(&mut out);
+    out
+}
+
+/// Serves `GET /metrics` for Prometheus to scrape.
+pub async fn serve(listen: &str) -> Result<()> {
+    let app = Router::new().route("/metrics", get(metrics));
+    let listener = TcpListener::bind(listen).await?;
+    tracing::info!("Serving metrics on {}", listen);
+    axum::serve(listener, app).await?;
+    Ok(())
+}
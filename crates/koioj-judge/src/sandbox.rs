@@ -5,18 +5,43 @@ use koioj_common::{
 };
 use serde::Deserialize;
 use std::fs::{self};
-use std::path::Path;
+use std::path::{Path, PathBuf};
 use std::process::Command;
 
-use crate::config::Config;
+use crate::{config::Config, judger::SyscallFilter};
 
 #[derive(Clone, Debug, Deserialize)]
+#[serde(rename_all = "camelCase")]
 pub struct LanguageConfig {
     pub install: Option<Vec<String>>,
     pub source: String,
     pub compile: Option<Vec<String>>,
     pub compiled: String,
     pub run: Vec<String>,
+    /// Applies to test runs, compilers are never filtered.
+    #[serde(default)]
+    pub syscall_filter: SyscallFilter,
+    /// Directory the install commands write to instead of the shared rootfs.
+    /// Sandboxes of the language see it stacked on top of `rootfsPath`.
+    pub rootfs_layer: Option<PathBuf>,
+    /// Source of a program that does nothing, run to measure the startup cost
+    /// of the language's runtime. Its time is added to every time limit and
+    /// subtracted from every run.
+    pub baseline: Option<String>,
+    /// Most the baseline may be in milliseconds, a longer measurement is cut
+    /// down to it so a bad one can't stretch every time limit. 1000 if unset.
+    pub baseline_max: Option<u32>,
+}
+
+impl LanguageConfig {
+    /// Rootfs layers of the language's sandboxes, the first on top.
+    pub fn rootfs_layers(&self, config: &Config) -> Vec<String> {
+        self.rootfs_layer
+            .iter()
+            .chain([&config.rootfs_path])
+            .map(|p| p.to_string_lossy().to_string())
+            .collect()
+    }
 }
 
 const CHROOT_PATH: &str = "/sbin:/bin:/usr/sbin:/usr/bin:/usr/local/sbin:/usr/local/bin";
@@ -79,10 +104,16 @@ pub fn install_sandbox(config: &Config) -> Result<()> {
     for (lang, lang_config) in &config.languages {
         if let Some(install_cmds) = &lang_config.install {
             tracing::info!("Installing {:?}...", lang);
+            // a language with a layer of its own installs into that through an
+            // overlay, its sandboxes stack it the same way
+            let chroot_dir = match &lang_config.rootfs_layer {
+                Some(layer) => mount_layer(output_dir, layer)?,
+                None => output_dir.clone(),
+            };
             for cmd in install_cmds {
                 tracing::info!("Executing: {}", cmd);
                 let status = Command::new("chroot")
-                    .arg(output_dir.to_str().unwrap())
+                    .arg(chroot_dir.to_str().unwrap())
                     .arg("/bin/sh")
                     .arg("-c")
                     .arg(format!("export PATH={} && {}", CHROOT_PATH, cmd))
@@ -93,9 +124,52 @@ pub fn install_sandbox(config: &Config) -> Result<()> {
                     tracing::error!("Warning: Command failed for {:?}: {}", lang, cmd);
                 }
             }
+            if let Some(layer) = &lang_config.rootfs_layer {
+                unmount_layer(layer)?;
+            }
         }
     }
 
     tracing::info!("Sandbox installation completed successfully!");
     Ok(())
 }
+
+/// Mounts `layer` as the writable upper dir of an overlay on `rootfs` and
+/// returns where the two are merged.
+fn mount_layer(rootfs: &Path, layer: &Path) -> Result<PathBuf> {
+    let work = layer.with_extension("work");
+    let merged = layer.with_extension("merged");
+    for dir in [layer, &work, &merged] {
+        fs::create_dir_all(dir)?;
+    }
+
+    let status = Command::new("mount")
+        .args(["-t", "overlay", "overlay", "-o"])
+        .arg(format!(
+            "lowerdir={},upperdir={},workdir={}",
+            rootfs.display(),
+            layer.display(),
+            work.display()
+        ))
+        .arg(&merged)
+        .status()
+        .context("Failed to execute mount")?;
+    if !status.success() {
+        bail!("Failed to mount layer {}", layer.display());
+    }
+    Ok(merged)
+}
+
+fn unmount_layer(layer: &Path) -> Result<()> {
+    let merged = layer.with_extension("merged");
+    let status = Command::new("umount")
+        .arg(&merged)
+        .status()
+        .context("Failed to execute umount")?;
+    if !status.success() {
+        bail!("Failed to unmount {}", merged.display());
+    }
+    let _ = fs::remove_dir(&merged);
+    let _ = fs::remove_dir_all(layer.with_extension("work"));
+    Ok(())
+}
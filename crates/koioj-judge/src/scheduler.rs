@@ -0,0 +1,161 @@
+// koioj-judge/src/scheduler.rs
+
+use std::{
+    collections::HashMap,
+    sync::{Arc, Mutex},
+};
+
+use koioj_common::judge::Priority;
+use tokio::sync::oneshot;
+
+/// Who a slot is for. Higher priorities go first, within one priority the
+/// user with the fewest slots held does, then the one who asked first.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Ticket {
+    pub priority: Priority,
+    pub user_id: i32,
+}
+
+struct Waiter {
+    ticket: Ticket,
+    seq: u64,
+    wake: oneshot::Sender<()>,
+}
+
+struct State {
+    free: usize,
+    held: HashMap<i32, usize>,
+    waiting: Vec<Waiter>,
+    seq: u64,
+}
+
+impl State {
+    fn take(&mut self, user_id: i32) {
+        self.free -= 1;
+        *self.held.entry(user_id).or_default() += 1;
+    }
+
+    fn put(&mut self, user_id: i32) {
+        self.free += 1;
+        if let Some(held) = self.held.get_mut(&user_id) {
+            *held -= 1;
+            if *held == 0 {
+                self.held.remove(&user_id);
+            }
+        }
+    }
+
+    // hands free slots to the waiters first in line, skipping the ones that
+    // gave up waiting
+    fn dispatch(&mut self) {
+        while self.free > 0 && !self.waiting.is_empty() {
+            let next = (0..self.waiting.len())
+                .min_by_key(|&i| {
+                    let waiter = &self.waiting[i];
+                    let held = self.held.get(&waiter.ticket.user_id).copied();
+                    (
+                        std::cmp::Reverse(waiter.ticket.priority),
+                        held.unwrap_or(0),
+                        waiter.seq,
+                    )
+                })
+                .unwrap();
+            let waiter = self.waiting.swap_remove(next);
+            self.take(waiter.ticket.user_id);
+            if waiter.wake.send(()).is_err() {
+                self.put(waiter.ticket.user_id);
+            }
+        }
+    }
+}
+
+/// Counting semaphore whose waiters are served by priority and fair share
+/// instead of in arrival order, so a bulk rejudge queues behind live contest
+/// submissions and one user's burst behind everyone else's first tasks.
+pub struct Scheduler {
+    state: Mutex<State>,
+}
+
+impl Scheduler {
+    pub fn new(slots: usize) -> Arc<Self> {
+        Arc::new(Self {
+            state: Mutex::new(State {
+                free: slots,
+                held: HashMap::new(),
+                waiting: Vec::new(),
+                seq: 0,
+            }),
+        })
+    }
+
+    pub fn free_slots(&self) -> usize {
+        self.state.lock().unwrap().free
+    }
+
+    /// Waits for a slot. Dropping the future before it resolves gives up the
+    /// place in line.
+    pub async fn acquire(self: &Arc<Self>, ticket: Ticket) -> SchedulerPermit {
+        let wake = {
+            let mut state = self.state.lock().unwrap();
+            if state.free > 0 && state.waiting.is_empty() {
+                state.take(ticket.user_id);
+                None
+            } else {
+                let (wake, woken) = oneshot::channel();
+                state.seq += 1;
+                let seq = state.seq;
+                state.waiting.push(Waiter { ticket, seq, wake });
+                Some(woken)
+            }
+        };
+        // the slot is taken for us before the wakeup is sent
+        if let Some(woken) = wake {
+            let mut waiting = Waiting {
+                scheduler: self,
+                user_id: ticket.user_id,
+                woken: Some(woken),
+            };
+            let _ = waiting.woken.as_mut().unwrap().await;
+            waiting.woken = None;
+        }
+        SchedulerPermit {
+            scheduler: self.clone(),
+            user_id: ticket.user_id,
+        }
+    }
+
+    fn release(&self, user_id: i32) {
+        let mut state = self.state.lock().unwrap();
+        state.put(user_id);
+        state.dispatch();
+    }
+}
+
+// a cancelled acquire, which may have been handed a slot already
+struct Waiting<'a> {
+    scheduler: &'a Scheduler,
+    user_id: i32,
+    woken: Option<oneshot::Receiver<()>>,
+}
+
+impl Drop for Waiting<'_> {
+    fn drop(&mut self) {
+        if let Some(mut woken) = self.woken.take() {
+            woken.close();
+            if woken.try_recv().is_ok() {
+                self.scheduler.release(self.user_id);
+            }
+        }
+    }
+}
+
+pub struct SchedulerPermit {
+    scheduler: Arc<Scheduler>,
+    user_id: i32,
+}
+
+impl Drop for SchedulerPermit {
+    fn drop(&mut self) {
+        self.scheduler.release(self.user_id);
+    }
+}
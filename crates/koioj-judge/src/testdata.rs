@@ -0,0 +1,270 @@
+// koioj-judge/src/testdata.rs
+
+use std::{
+    collections::HashMap,
+    path::{Path, PathBuf},
+    sync::Mutex,
+};
+
+use koioj_common::{
+    error::{Error, Result},
+    judge::{JudgeToApiMessage, TestCase, TestCaseRef},
+};
+use tokio::sync::{mpsc::UnboundedSender, oneshot};
+use uuid::Uuid;
+
+/// How long a task waits for the API to send the test data it is missing.
+const FETCH_TIMEOUT: tokio::time::Duration = tokio::time::Duration::from_secs(60);
+
+struct Entries {
+    /// Bytes on disk and last use of each cached hash.
+    map: HashMap<String, (u64, u64)>,
+    size: u64,
+    tick: u64,
+    /// Running submissions by the hashes they use, cached or not yet.
+    held: HashMap<String, usize>,
+}
+
+/// Test data on disk, keyed by content hash, so a problem's data crosses the
+/// websocket once per judge instead of with every submission. The judger opens
+/// the files directly on the host side. Beyond `capacity` bytes the least
+/// recently used data no running submission holds is removed.
+pub struct TestDataCache {
+    dir: PathBuf,
+    capacity: u64,
+    entries: Mutex<Entries>,
+    /// Hashes being fetched, with the tasks waiting for them.
+    waiting: Mutex<HashMap<String, Vec<oneshot::Sender<()>>>>,
+}
+
+/// Test data a submission uses, kept in the cache until this is dropped.
+pub struct HeldTestData<'a> {
+    cache: &'a TestDataCache,
+    hashes: Vec<String>,
+}
+
+impl Drop for HeldTestData<'_> {
+    fn drop(&mut self) {
+        let mut entries = self.cache.entries.lock().unwrap();
+        for hash in &self.hashes {
+            if let Some(held) = entries.held.get_mut(hash) {
+                *held -= 1;
+                if *held == 0 {
+                    entries.held.remove(hash);
+                }
+            }
+        }
+        self.cache.evict(&mut entries);
+    }
+}
+
+impl TestDataCache {
+    /// Picks up the data a previous run left in `dir`, the oldest first out.
+    pub fn new(dir: PathBuf, capacity: u64) -> std::io::Result<Self> {
+        std::fs::create_dir_all(&dir)?;
+        // the judger sees it from inside its own mount namespace
+        let dir = std::path::absolute(dir)?;
+
+        let mut found = Vec::new();
+        for entry in std::fs::read_dir(&dir)? {
+            let path = entry?.path();
+            let name = path.file_name().unwrap_or_default().to_string_lossy();
+            // interrupted writes, of a temporary file or before the answer
+            if name.starts_with('.')
+                || name
+                    .strip_suffix(".in")
+                    .is_some_and(|hash| !dir.join(format!("{}.ans", hash)).exists())
+            {
+                let _ = std::fs::remove_file(&path);
+                continue;
+            }
+            let Some(hash) = name.strip_suffix(".ans") else {
+                continue;
+            };
+            let input = dir.join(format!("{}.in", hash));
+            match (std::fs::metadata(&input), path.metadata()) {
+                (Ok(input_meta), Ok(answer_meta)) => found.push((
+                    answer_meta.modified()?,
+                    hash.to_string(),
+                    input_meta.len() + answer_meta.len(),
+                )),
+                _ => {
+                    let _ = std::fs::remove_file(&path);
+                }
+            }
+        }
+        found.sort();
+
+        let mut entries = Entries {
+            map: HashMap::new(),
+            size: 0,
+            tick: 0,
+            held: HashMap::new(),
+        };
+        for (_, hash, bytes) in found {
+            entries.tick += 1;
+            entries.size += bytes;
+            entries.map.insert(hash, (bytes, entries.tick));
+        }
+        let cache = Self {
+            dir,
+            capacity,
+            entries: Mutex::new(entries),
+            waiting: Mutex::new(HashMap::new()),
+        };
+        cache.evict(&mut cache.entries.lock().unwrap());
+        Ok(cache)
+    }
+
+    /// Input and answer files of the test data with `hash`.
+    pub fn paths(&self, hash: &str) -> (PathBuf, PathBuf) {
+        (
+            self.dir.join(format!("{}.in", hash)),
+            self.dir.join(format!("{}.ans", hash)),
+        )
+    }
+
+    /// Waits until every test case is cached, fetching the missing ones. They
+    /// stay cached while the returned hold lives.
+    pub async fn ensure(
+        &self,
+        test_cases: &[TestCaseRef],
+        tx: &UnboundedSender<JudgeToApiMessage>,
+    ) -> Result<HeldTestData<'_>> {
+        // held before they are even there, so nothing evicts them on arrival
+        let held = self.hold(test_cases);
+        let mut fetch = Vec::new();
+        let mut hashes = Vec::new();
+        let mut arrivals = Vec::new();
+        {
+            // checked under the lock, store() indexes before it takes it
+            let mut waiting = self.waiting.lock().unwrap();
+            for test_case in test_cases {
+                if self.touch(&test_case.hash) {
+                    continue;
+                }
+                let waiters = waiting.entry(test_case.hash.clone()).or_default();
+                // another task may have asked for it already
+                if waiters.is_empty() {
+                    fetch.push(test_case.id);
+                }
+                let (notify, arrival) = oneshot::channel();
+                waiters.push(notify);
+                hashes.push(test_case.hash.clone());
+                arrivals.push(arrival);
+            }
+        }
+        if arrivals.is_empty() {
+            return Ok(held);
+        }
+
+        tracing::debug!(
+            "Fetching {} test cases, waiting for {}",
+            fetch.len(),
+            arrivals.len()
+        );
+        if !fetch.is_empty() {
+            tx.send(JudgeToApiMessage::FetchTestCases(fetch))
+                .map_err(|_| Error::msg("Connection to the API is closed"))?;
+        }
+
+        let arrived = tokio::time::timeout(FETCH_TIMEOUT, futures::future::join_all(arrivals))
+            .await
+            .is_ok_and(|results| results.iter().all(|r| r.is_ok()));
+        if !arrived {
+            // forget the fetches so that the next task asks again
+            let mut waiting = self.waiting.lock().unwrap();
+            for hash in &hashes {
+                waiting.remove(hash);
+            }
+            return Err(Error::msg("Timed out fetching test data"));
+        }
+        Ok(held)
+    }
+
+    fn hold(&self, test_cases: &[TestCaseRef]) -> HeldTestData<'_> {
+        let mut entries = self.entries.lock().unwrap();
+        let hashes: Vec<String> = test_cases.iter().map(|t| t.hash.clone()).collect();
+        for hash in &hashes {
+            *entries.held.entry(hash.clone()).or_default() += 1;
+        }
+        HeldTestData {
+            cache: self,
+            hashes,
+        }
+    }
+
+    /// Marks `hash` as used now, false if it isn't cached.
+    fn touch(&self, hash: &str) -> bool {
+        let mut entries = self.entries.lock().unwrap();
+        entries.tick += 1;
+        let tick = entries.tick;
+        match entries.map.get_mut(hash) {
+            Some((_, used)) => {
+                *used = tick;
+                true
+            }
+            None => false,
+        }
+    }
+
+    // removes the least recently used unheld data until the rest fits. files
+    // go under the lock, so an entry fetched again isn't removed after the fact
+    fn evict(&self, entries: &mut Entries) {
+        while entries.size > self.capacity {
+            let oldest = entries
+                .map
+                .iter()
+                .filter(|(hash, _)| !entries.held.contains_key(*hash))
+                .min_by_key(|(_, (_, used))| *used)
+                .map(|(hash, _)| hash.clone());
+            let Some(oldest) = oldest else {
+                break;
+            };
+            let (bytes, _) = entries.map.remove(&oldest).unwrap();
+            entries.size -= bytes;
+            let (input, answer) = self.paths(&oldest);
+            // the answer first, it marks the entry complete
+            let _ = std::fs::remove_file(answer);
+            let _ = std::fs::remove_file(input);
+        }
+    }
+
+    /// Writes fetched test data to the cache and wakes the tasks waiting for it.
+    pub async fn store(&self, test_case: TestCase) -> Result<()> {
+        let hash = test_case.data.hash();
+        let (input, answer) = self.paths(&hash);
+        let bytes = (test_case.data.input.len() + test_case.data.output.len()) as u64;
+        // the answer goes last and marks the entry complete
+        self.write_atomic(&input, test_case.data.input).await?;
+        self.write_atomic(&answer, test_case.data.output).await?;
+
+        {
+            let mut entries = self.entries.lock().unwrap();
+            entries.tick += 1;
+            let tick = entries.tick;
+            if let Some((old, _)) = entries.map.insert(hash.clone(), (bytes, tick)) {
+                entries.size -= old;
+            }
+            entries.size += bytes;
+            self.evict(&mut entries);
+        }
+
+        let waiters = self.waiting.lock().unwrap().remove(&hash);
+        for notify in waiters.into_iter().flatten() {
+            let _ = notify.send(());
+        }
+        Ok(())
+    }
+
+    // renamed into place, so a sandbox never reads a partial file
+    async fn write_atomic(&self, path: &Path, content: String) -> Result<()> {
+        let tmp = self.dir.join(format!(".{}.tmp", Uuid::new_v4()));
+        tokio::fs::write(&tmp, content).await?;
+        if let Err(e) = tokio::fs::rename(&tmp, path).await {
+            let _ = tokio::fs::remove_file(&tmp).await;
+            return Err(e.into());
+        }
+        Ok(())
+    }
+}
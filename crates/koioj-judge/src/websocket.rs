@@ -1,4 +1,7 @@
-use crate::{config::Config, judge::JudgeExecutor};
+use crate::{
+    compile_cache::CompileCache, config::Config, judge::JudgeExecutor, scheduler::Ticket,
+    testdata::TestDataCache,
+};
 use futures::{SinkExt, StreamExt};
 use koioj_common::error::{Context, Result};
 use koioj_common::judge::{ApiToJudgeMessage, JudgeInfo, JudgeTask, JudgeToApiMessage};
@@ -8,17 +11,44 @@ use tokio_tungstenite::{
     connect_async_with_config, tungstenite::Message, tungstenite::protocol::WebSocketConfig,
 };
 
+const DEFAULT_COMPILE_CACHE_SIZE: usize = 256;
+const DEFAULT_TESTDATA_CACHE_SIZE: u64 = 4 * 1024 * 1024 * 1024;
+
 pub async fn run(config: Config) -> Result<()> {
     let ws_url = config
         .api_url
         .replace("http://", "ws://")
         .replace("https://", "wss://");
     let ws_url = format!("{}/api/judge/ws", ws_url);
+    let testdata = Arc::new(
+        TestDataCache::new(
+            config.work_dir.join("testdata"),
+            config
+                .testdata_cache_size
+                .unwrap_or(DEFAULT_TESTDATA_CACHE_SIZE),
+        )
+        .context("Failed to create test data cache")?,
+    );
+    let compile_cache = Arc::new(
+        CompileCache::new(
+            config.work_dir.join("compile_cache"),
+            config
+                .compile_cache_size
+                .unwrap_or(DEFAULT_COMPILE_CACHE_SIZE),
+        )
+        .context("Failed to create compile cache")?,
+    );
+    // outlives the connections, its pool holds the sandboxes and their cores
+    let executor = Arc::new(RwLock::new(JudgeExecutor::new(
+        config.clone(),
+        testdata.clone(),
+        compile_cache,
+    )));
 
     loop {
         tracing::info!("Connecting to {}", ws_url);
 
-        match connect_and_handle(&ws_url, &config).await {
+        match connect_and_handle(&ws_url, &config, &executor, &testdata).await {
             Ok(_) => {
                 tracing::info!("Connection closed normally");
             }
@@ -32,7 +62,12 @@ pub async fn run(config: Config) -> Result<()> {
     }
 }
 
-async fn connect_and_handle(url: &str, config: &Config) -> Result<()> {
+async fn connect_and_handle(
+    url: &str,
+    config: &Config,
+    executor: &Arc<RwLock<JudgeExecutor>>,
+    testdata: &Arc<TestDataCache>,
+) -> Result<()> {
     let mut ws_config = WebSocketConfig::default();
     ws_config.max_message_size = Some(1024 * 1024 * 1024);
     ws_config.max_frame_size = Some(1024 * 1024 * 1024);
@@ -45,8 +80,6 @@ async fn connect_and_handle(url: &str, config: &Config) -> Result<()> {
 
     let (mut write, mut read) = ws_stream.split();
 
-    let executor = Arc::new(RwLock::new(JudgeExecutor::new(config.clone())));
-
     let private_key = koioj_common::auth::load_private_key(&config.private_key_path)
         .context("Failed to load private key")?;
 
@@ -93,7 +126,7 @@ async fn connect_and_handle(url: &str, config: &Config) -> Result<()> {
 
             let load = {
                 let exec = executor_clone.read().await;
-                exec.get_load().await
+                exec.get_load()
             };
 
             let _ = tx_clone.send(JudgeToApiMessage::Ping(load));
@@ -106,7 +139,7 @@ async fn connect_and_handle(url: &str, config: &Config) -> Result<()> {
     while let Some(msg) = read.next().await {
         match msg {
             Ok(Message::Text(text)) => {
-                if let Err(e) = handle_message(&text, &executor_clone, &tx_clone).await {
+                if let Err(e) = handle_message(&text, &executor_clone, testdata, &tx_clone).await {
                     tracing::error!("Failed to handle message: {:?}", e);
                 }
             }
@@ -131,6 +164,7 @@ async fn connect_and_handle(url: &str, config: &Config) -> Result<()> {
 async fn handle_message(
     text: &str,
     executor: &Arc<RwLock<JudgeExecutor>>,
+    testdata: &Arc<TestDataCache>,
     tx: &tokio::sync::mpsc::UnboundedSender<JudgeToApiMessage>,
 ) -> Result<()> {
     let msg: ApiToJudgeMessage = serde_json::from_str(text).context("Failed to parse message")?;
@@ -139,6 +173,17 @@ async fn handle_message(
         ApiToJudgeMessage::Pong => {
             tracing::debug!("Received pong");
         }
+        ApiToJudgeMessage::TestCases(test_cases) => {
+            let testdata = testdata.clone();
+            tokio::spawn(async move {
+                for test_case in test_cases {
+                    let id = test_case.id;
+                    if let Err(e) = testdata.store(test_case).await {
+                        tracing::error!("Failed to cache test case {}: {:?}", id, e);
+                    }
+                }
+            });
+        }
         ApiToJudgeMessage::JudgeTask(JudgeTask {
             submission_id,
             lang,
@@ -146,6 +191,10 @@ async fn handle_message(
             time_limit,
             memory_limit,
             test_cases,
+            checker,
+            stop_on_failure,
+            priority,
+            user_id,
         }) => {
             tracing::info!("Received judge task for submission {}", submission_id);
 
@@ -153,7 +202,7 @@ async fn handle_message(
             let tx = tx.clone();
 
             tokio::spawn(async move {
-                let mut exec = executor.write().await;
+                let exec = executor.read().await;
                 exec.execute_task(
                     submission_id,
                     lang,
@@ -161,6 +210,9 @@ async fn handle_message(
                     time_limit,
                     memory_limit,
                     test_cases,
+                    checker,
+                    stop_on_failure,
+                    Ticket { priority, user_id },
                     tx,
                 )
                 .await;
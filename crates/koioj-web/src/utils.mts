@@ -8,6 +8,16 @@ export function parseIntOrNull(value: string | string[] | null | undefined): num
   return Number.isNaN(parsed) ? null : parsed;
 }
 
+export function formatMemory(kb: number | null | undefined): string {
+  if (kb == null) return '-';
+  return kb < 1024 ? `${kb} KB` : `${(kb / 1024).toFixed(2)} MB`;
+}
+
+export function formatTimeUs(us: number | null | undefined): string {
+  if (us == null) return '-';
+  return `${(us / 1000).toFixed(3)} ms`;
+}
+
 export const SOURCE_REPO = `https://github.com/ParaN3xus/koioj/`
 
 export const APP_NAME = 'KoiOJ'
\ No newline at end of file
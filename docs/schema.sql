@@ -5,12 +5,13 @@ CREATE TYPE contest_type_enum AS ENUM ('public', 'private');
 CREATE TYPE contest_status_enum AS ENUM ('active', 'inactive');
 CREATE TYPE submission_result_enum AS ENUM (
     'pending', 'accepted', 'wrong_answer', 'time_limit_exceeded', 
-    'memory_limit_exceeded', 'runtime_error', 'compile_error', 'unknown_error'
+    'memory_limit_exceeded', 'output_limit_exceeded', 'runtime_error',
+    'compile_error', 'unknown_error'
 );
 CREATE TYPE test_case_result_enum AS ENUM (
     'pending', 'compiling', 'running', 'accepted', 'wrong_answer', 
-    'time_limit_exceeded', 'memory_limit_exceeded', 'runtime_error', 
-    'compile_error', 'unknown_error'
+    'time_limit_exceeded', 'memory_limit_exceeded', 'output_limit_exceeded',
+    'runtime_error', 'compile_error', 'unknown_error'
 );
 
 CREATE TABLE users (
@@ -39,6 +40,7 @@ CREATE TABLE problems (
 CREATE TABLE test_cases (
     id SERIAL PRIMARY KEY,
     problem_id INTEGER NOT NULL REFERENCES problems(id) ON DELETE CASCADE,
+    content_hash TEXT,
     created_at TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT NOW()
 );
 
@@ -83,6 +85,8 @@ CREATE TABLE submission_test_cases (
     result test_case_result_enum NOT NULL DEFAULT 'pending',
     time_consumption INTEGER,
     mem_consumption INTEGER,
+    time_us BIGINT,
+    wall_time_us BIGINT,
     PRIMARY KEY (submission_id, test_case_id)
 );
 